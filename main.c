@@ -1,11 +1,31 @@
 #define _GNU_SOURCE
 #include <stdio.h>
+#include <stddef.h>
 #include <stdint.h>
+#include <stdlib.h>
 #include <string.h>
 #include <getopt.h>
-
-#define SEGMENT_SIZE (1024 * 1024) // 1MB segments
-#define BLOCK_SIZE 4096            // 4KB blocks
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#include <endian.h>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+// <linux/io_uring.h> pulls in <linux/fs.h>, which defines its own BLOCK_SIZE
+#undef BLOCK_SIZE
+
+#define SEGMENT_SIZE (1024 * 1024) // 1MB segments, default for new volumes (see superblock_t)
+#define BLOCK_SIZE 4096            // 4KB blocks, default for new volumes and size of the inode and directory records
+#define MAX_BLOCK_SIZE (1024 * 1024)
 #define INODE_SIZE BLOCK_SIZE      // Each inode is one block
 #define DATA_SIZE BLOCK_SIZE       // Each inode is one block
 
@@ -26,6 +46,8 @@
 /* Segment file name pattern */
 #define INODE_SEGMENT_NAME_PATTERN "inodeseg%d"
 #define DATA_SEGMENT_NAME_PATTERN "dataseg%d"
+#define IMAGE_FILE_NAME "exfs.img"
+#define SUPERBLOCK_FILE_NAME "superblock"
 
 // Defining placeholder value
 #define MAX_UNIT_32 (UINT32_MAX - 1)
@@ -33,16 +55,81 @@
 
 #define USE_SINGLE_INDIRECT 0
 
+// An extent: length blocks of a file from logical block logical on, stored in consecutive block numbers from physical on. In an index node of an extent tree, physical is the extent-tree block covering the file from logical on and length is 0.
+typedef struct
+{
+    uint32_t logical;
+    uint32_t physical;
+    uint32_t length;
+} extent_t;
+
+// Header of a node of an extent tree, followed by its records sorted by logical block
+typedef struct
+{
+    uint32_t count; // Records in use
+    uint32_t depth; // 0 for a node of extents, else the number of levels of extent-tree blocks below the node
+} extent_header_t;
+
+#define INODE_EXTENT_RECORDS ((MAX_DIRECT_BLOCKS * sizeof(uint32_t) - sizeof(extent_header_t)) / sizeof(extent_t)) // Records in the root node held by the inode
+#define INODE_INLINE_BYTES (MAX_DIRECT_BLOCKS * sizeof(uint32_t))                                                   // Bytes of data an INODE_INLINE file holds in the inode
+
 typedef struct
 {
     uint32_t type;                             // File type (regular or directory)
     uint64_t size;                             // File size in bytes
-    uint32_t direct_blocks[MAX_DIRECT_BLOCKS]; // Direct block pointers
+    union
+    {
+        uint32_t direct_blocks[MAX_DIRECT_BLOCKS]; // Direct block pointers
+        struct
+        {
+            extent_header_t extent_header;          // Root of the extent tree of an INODE_EXTENTS file
+            extent_t extents[INODE_EXTENT_RECORDS]; // Its records
+        };
+        uint8_t inline_data[INODE_INLINE_BYTES]; // The data of an INODE_INLINE file
+    };
     uint32_t single_indirect;                  // Single indirect block
     uint32_t double_indirect;                  // Double indirect block
-    // uint32_t triple_indirect;                  // Triple indirect block
+    uint32_t flags;                            // INODE_* flags, 0 in inodes written before flags existed
+    uint32_t triple_indirect;                  // Triple indirect block, 0 in inodes written before it existed
 } inode_t;
 
+/* Inode flags */
+#define INODE_POINTER_ARRAYS 0x1 // Indirect blocks are flat arrays of block numbers rather than directory entries
+#define INODE_EXTENTS 0x2        // The data is mapped by the extent tree rooted in the inode instead of block pointers
+#define INODE_INLINE 0x4         // The data is stored in the inode itself and the file has no data blocks
+
+// On-disk inode of a volume flagged SUPERBLOCK_COMPACT_INODES, packed geometry.inodes_per_block to a block (16 with 4KB blocks). Inode number n is record n % inodes_per_block of inode block n / inodes_per_block. It holds the fields of an inode_t with a block map area of 228 bytes instead of 3936, so it has fewer direct blocks (57), root extent records (18) and inline bytes; read_inode and write_inode translate between the two. On volumes flagged SUPERBLOCK_COMPACT_TRIPLE_INDIRECT the triple indirect block takes the first 4 bytes of the area; older compact volumes have no triple indirect block and use all 232 bytes for the map. A record of type 0 is free.
+#define COMPACT_INODE_SIZE 256
+#define COMPACT_AREA_BYTES (COMPACT_INODE_SIZE - 24)
+
+typedef struct
+{
+    uint32_t type; // File type, 0 for a free record
+    uint32_t flags;
+    uint64_t size;
+    uint32_t single_indirect;
+    uint32_t double_indirect;
+    uint8_t area[COMPACT_AREA_BYTES]; // The triple indirect block, if the volume has them, then the start of the direct_blocks, extents or inline_data area of the inode_t
+} compact_inode_t;
+
+_Static_assert(sizeof(compact_inode_t) == COMPACT_INODE_SIZE, "compact inode size");
+
+// Capacity of the block map area of an inode in the format of the open volume
+#define INODE_DIRECT_SLOTS (geometry.inode_map_bytes / sizeof(uint32_t))
+#define INODE_ROOT_EXTENTS ((geometry.inode_map_bytes - sizeof(extent_header_t)) / sizeof(extent_t))
+#define INODE_INLINE_LIMIT (geometry.inode_map_bytes)
+
+// Block numbers held by an indirect block of an INODE_POINTER_ARRAYS inode, 1024 with 4KB blocks. Unused slots hold MAX_UNIT_32.
+#define POINTERS_PER_BLOCK (geometry.block_size / sizeof(uint32_t))
+
+// Block numbers a map builder puts in an indirect block before it starts the next one, at most POINTERS_PER_BLOCK. make check lowers it so that a file of a few hundred blocks needs a triple indirect block; readers skip the unused slots either way.
+#ifndef INDIRECT_FANOUT
+#define INDIRECT_FANOUT POINTERS_PER_BLOCK
+#endif
+
+// Records held by an extent-tree block after its header, 340 with 4KB blocks
+#define EXTENTS_PER_BLOCK ((geometry.block_size - sizeof(extent_header_t)) / sizeof(extent_t))
+
 typedef struct
 {
     char data[BLOCK_SIZE]; // Data block content
@@ -64,2083 +151,5405 @@ typedef struct
     directory_entry_t entries[MAX_DIRECTORY_ENTRIES]; // Directory entries
 } directoryblock_t;
 
-// function read_directory_block that takes a directory block number and read the directory block from the segment file. If the directory block number is greater than 255 take divisor as a file name number and take the remainder as the directory block number. Read the segment file and read the directory block from the file. If the file is not found return -1. If the directory block is not found return -2. If the directory block is found return 0.
-int read_directory_block(int directory_block_number, directoryblock_t *directory_block)
+/* Segment kinds, used to index the segment handle table */
+#define SEGMENT_KIND_INODE 0
+#define SEGMENT_KIND_DATA 1
+
+// Map every segment file with mmap and access bitmaps and blocks through the mapping. Segments that can't be mapped fall back to pread/pwrite.
+#ifndef USE_MMAP_SEGMENTS
+#define USE_MMAP_SEGMENTS 1
+#endif
+
+// Format new volumes as a single image file (IMAGE_FILE_NAME) instead of one file per segment. An existing image is always used, whatever this is set to, and legacy volumes can be converted with -C.
+#ifndef USE_IMAGE_FILE
+#define USE_IMAGE_FILE 0
+#endif
+
+// Reserve the whole segment with fallocate when it is created, so the host filesystem allocates it as one contiguous extent instead of piecemeal as block slots are first written. Filesystems without fallocate keep a sparse segment.
+#ifndef USE_FALLOCATE
+#define USE_FALLOCATE 0
+#endif
+
+// Release the host disk space of freed block slots by punching holes in the segments with fallocate, and drop segments left completely free at the end of the volume. Both happen once per operation in sync_segments().
+#ifndef USE_PUNCH_HOLE
+#define USE_PUNCH_HOLE 1
+#endif
+
+// Store the data of new files of up to INODE_INLINE_LIMIT bytes in their inode instead of a data block, so a small file costs one block and one read
+#ifndef USE_INLINE_DATA
+#define USE_INLINE_DATA 1
+#endif
+
+// Format new volumes with compact_inode_t inodes packed many to a block instead of one inode_t per block, so reading an inode brings its neighbours into the block cache with it. Volumes keep the format they were created with.
+#ifndef USE_COMPACT_INODES
+#define USE_COMPACT_INODES 1
+#endif
+
+// Map the data of new files with an extent tree, one record per run of consecutive blocks. With 0, new files use direct blocks and indirect blocks of block pointers. Files are read in whichever format they were written.
+#ifndef USE_EXTENTS
+#define USE_EXTENTS 1
+#endif
+
+// Format new volumes with bit-packed bitmaps, one bit per block slot instead of one byte. Volumes keep the format they were created with.
+#ifndef USE_PACKED_BITMAPS
+#define USE_PACKED_BITMAPS 1
+#endif
+
+// Number of blocks kept in the LRU buffer cache that sits under read_block/write_block/create_block
+#ifndef BLOCK_CACHE_BLOCKS
+#define BLOCK_CACHE_BLOCKS 64
+#endif
+#define BLOCK_CACHE_BUCKETS (BLOCK_CACHE_BLOCKS * 2)
+
+// Build with -DEXFS_STATS to count I/O events and print them to stderr on exit (see `make bench`)
+#ifdef EXFS_STATS
+static struct
 {
-    uint8_t bitmap[MAX_DATA_BLOCKS];
-    FILE *file = NULL;
-    char filename[32];
-    int segment_num = directory_block_number / 255;           // Calculate segment number
-    int directory_block_index = directory_block_number % 255; // Calculate directory block index
-
-    // Generate segment filename
-    sprintf(filename, DATA_SEGMENT_NAME_PATTERN, segment_num);
-
-    // Try to open the file
-    file = fopen(filename, "r+b");
-    if (file == NULL)
+    unsigned long segment_opens;    // Segment files opened
+    unsigned long segment_maps;     // Segment files mapped with mmap
+    unsigned long preads;           // pread calls on segment descriptors
+    unsigned long pwrites;          // pwrite calls on segment descriptors
+    unsigned long msyncs;           // msync calls issued for dirty mappings
+    unsigned long cache_hits;       // Block lookups served by the buffer cache
+    unsigned long cache_misses;     // Block lookups that went to the segment
+    unsigned long cache_writebacks; // Dirty blocks written back to a segment
+    unsigned long async_batches;    // Batches handed to the async read engine
+    unsigned long uring_submits;    // io_uring_enter calls that submitted reads
+    unsigned long async_read_ops;   // Vectored reads issued by the async read engine
+    unsigned long readahead_hints;  // posix_fadvise/madvise WILLNEED hints issued by extract_file
+    unsigned long fallocates;       // Segments preallocated with fallocate
+    unsigned long hole_punches;     // Runs of freed block slots released with FALLOC_FL_PUNCH_HOLE
+    unsigned long segments_trimmed; // Free segments removed from the end of the volume
+    unsigned long alloc_segment_visits; // Segments opened and searched by create_block
+    unsigned long blocks_relocated; // Data blocks copied into a new extent by the defragmenter
+    unsigned long read_bytes;       // File data streamed by extract_file
+    double read_seconds;            // Time spent streaming it
+} exfs_stats;
+#define STAT_INC(counter) (exfs_stats.counter++)
+#define STAT_ADD(counter, value) (exfs_stats.counter += (value))
+
+static void print_stats()
+{
+    fprintf(stderr, "exfs stats: segment opens %lu, segment maps %lu, msyncs %lu, preads %lu, pwrites %lu\n",
+            exfs_stats.segment_opens, exfs_stats.segment_maps, exfs_stats.msyncs, exfs_stats.preads, exfs_stats.pwrites);
+    fprintf(stderr, "exfs stats: cache hits %lu, cache misses %lu, cache writebacks %lu\n",
+            exfs_stats.cache_hits, exfs_stats.cache_misses, exfs_stats.cache_writebacks);
+    fprintf(stderr, "exfs stats: async read batches %lu, async read ops %lu, io_uring submits %lu, readahead hints %lu\n",
+            exfs_stats.async_batches, exfs_stats.async_read_ops, exfs_stats.uring_submits, exfs_stats.readahead_hints);
+    fprintf(stderr, "exfs stats: fallocates %lu, allocator segment visits %lu, hole punches %lu, segments trimmed %lu\n",
+            exfs_stats.fallocates, exfs_stats.alloc_segment_visits, exfs_stats.hole_punches, exfs_stats.segments_trimmed);
+    if (exfs_stats.blocks_relocated > 0)
     {
-        // perror("Failed to open data segment file");
-        return -1; // File not found
+        fprintf(stderr, "exfs stats: defragmenter relocated %lu blocks\n", exfs_stats.blocks_relocated);
     }
-
-    // Read the bitmap from the file
-    if (fread(bitmap, sizeof(bitmap), 1, file) != 1)
+    if (exfs_stats.read_bytes > 0)
     {
-        fclose(file);
-        return -2; // Failed to read bitmap
+        fprintf(stderr, "exfs stats: sequential read %lu bytes in %.2f ms, %.1f MB/s\n", exfs_stats.read_bytes,
+                exfs_stats.read_seconds * 1000, exfs_stats.read_bytes / exfs_stats.read_seconds / (1024 * 1024));
     }
+}
+#else
+#define STAT_INC(counter) ((void)0)
+#define STAT_ADD(counter, value) ((void)0)
+#endif
 
-    // Check if the directory block is used
-    if (bitmap[directory_block_index] == 0)
-    {
-        fclose(file);
-        return -2; // Directory block not found
-    }
+typedef struct
+{
+    int fd;             // Open descriptor, -1 if not opened yet
+    off_t base;         // Offset of the segment inside the file, non zero for image volumes
+    uint8_t *map;       // The whole segment mapped with mmap, NULL when pread/pwrite is used
+    uint8_t *bitmap;    // Segment bitmap, points into the mapping or to a copy loaded on open
+    int bitmap_dirty;   // The bitmap copy was modified and must be written back
+    int bitmap_changed; // The bitmap was modified since its largest free run was measured
+    size_t dirty_start; // Byte range of the mapping written since the last msync
+    size_t dirty_end;
+} segment_handle_t;
+
+// Per-process table of open segment files. Every inodeseg%d/dataseg%d file is opened once on first use and kept open until close_segment_files(), so the block accessors below don't pay an open/close per access. The table grows as new segments are created.
+typedef struct
+{
+    segment_handle_t *segments; // Handle per segment number
+    int capacity;               // Number of slots allocated in segments
+} segment_table_t;
 
-    // Read the directory block from the file
-    fseek(file, (directory_block_index + 1) * BLOCK_SIZE, SEEK_SET);
-    size_t read = fread(directory_block, sizeof(directoryblock_t), 1, file);
-    fclose(file);
+static segment_table_t segment_tables[2];
+
+// Growable list of block numbers
+typedef struct
+{
+    uint32_t *blocks;
+    int count;
+    int capacity;
+} block_list_t;
 
-    if (read != 1)
+static int block_list_append(block_list_t *list, uint32_t block_number)
+{
+    if (list->count == list->capacity)
     {
-        return -2; // Failed to read directory block
+        int capacity = list->capacity > 0 ? list->capacity * 2 : 256;
+        uint32_t *blocks = realloc(list->blocks, capacity * sizeof(uint32_t));
+        if (blocks == NULL)
+        {
+            return -1;
+        }
+        list->blocks = blocks;
+        list->capacity = capacity;
     }
 
-    return 0; // Success
+    list->blocks[list->count++] = block_number;
+    return 0;
 }
 
-// function to read the inode from a segment file. If the inode number is greater than 255 take divisor as a file name number and take the remainder as the inode number. Read the segment file and read the inode from the file. If the file is not found return -1. If the inode is not found return -2. If the inode is found return 0.
-int read_inode(int inode_number, inode_t *inode)
+// Block slots freed during the current operation, per segment kind, waiting for their space to be released
+static block_list_t freed_blocks[2];
+
+// Superblock recording the geometry a volume was formatted with, followed by the allocation summary. Volumes made of segment files keep them in SUPERBLOCK_FILE_NAME, image volumes in the reserved area at the start of the image.
+#define SUPERBLOCK_MAGIC "EXFS2SB1"
+#define SUPERBLOCK_SIZE 4096                // Reserved area of images written before reserved_size existed
+#define IMAGE_RESERVED_SIZE (256 * 1024)    // Reserved area of new images
+#define SUMMARY_OFFSET 64                   // Offset of the allocation summary after the superblock
+
+/* Superblock flags */
+#define SUPERBLOCK_PACKED_BITMAP 0x1 // Segment bitmaps hold one bit per block slot
+#define SUPERBLOCK_ALLOC_SUMMARY 0x2 // The allocation summary and first_free are maintained
+#define SUPERBLOCK_RUN_SUMMARY 0x4   // Summary entries also record the largest free run of their segment
+#define SUPERBLOCK_COMPACT_INODES 0x8 // Inodes are compact_inode_t records packed into the inode blocks
+#define SUPERBLOCK_COMPACT_TRIPLE_INDIRECT 0x10 // Compact inode records hold a triple indirect block ahead of their block map area
+
+typedef struct
 {
-    uint8_t bitmap[BITMAP_BYTES];
-    FILE *file = NULL;
-    char filename[32];
-    int segment_num = inode_number / 255; // Calculate segment number
-    int inode_index = inode_number % 255; // Calculate inode index
+    char magic[8];             // SUPERBLOCK_MAGIC
+    uint32_t segment_size;     // Bytes per segment, including the bitmap block
+    uint32_t block_size;       // Bytes per block slot
+    uint32_t segment_count[2]; // Number of segments created per segment kind
+    uint32_t flags;            // SUPERBLOCK_* flags, 0 in superblocks written before flags existed
+    uint32_t first_free[2];    // Per segment kind, every segment before this one is full
+    uint32_t reserved_size;    // Bytes reserved for the superblock and summary at the start of an image, 0 for SUPERBLOCK_SIZE
+    uint32_t next_fit[2];      // Per segment kind, the block after the last one create_block allocated, where its next search starts. 0 in superblocks written before it existed. With SUPERBLOCK_COMPACT_INODES the inode entry is the block after the one create_inode fills next
+} superblock_t;
+
+_Static_assert(sizeof(superblock_t) <= SUMMARY_OFFSET, "superblock overlaps the allocation summary");
+
+static superblock_t superblock;
+static int superblock_fd = -1; // Descriptor the superblock is written back to, the image itself for image volumes
+
+// Geometry of the open volume, derived from the superblock. Every segment is a bitmap block followed by blocks_per_segment block slots, and block number n lives in slot n % blocks_per_segment of segment n / blocks_per_segment. Directory records, and inodes of volumes without compact inodes, keep their BLOCK_SIZE layout at the start of a slot; file data uses the whole slot.
+static struct
+{
+    uint32_t block_size;
+    uint32_t segment_size;
+    uint32_t blocks_per_segment; // Block slots per segment
+    uint32_t bitmap_bytes;       // Size of the bitmap at the start of each segment
+    int packed_bitmap;           // The bitmap holds one bit per block slot instead of one byte
+    uint32_t inodes_per_block;   // Inodes per inode block, 1 unless the volume has compact inodes
+    uint32_t inode_map_bytes;    // Size of the block map area of an inode: direct blocks, root extents or inline data
+    int triple_indirect;         // Inodes can hold a triple indirect block
+} geometry = {BLOCK_SIZE, SEGMENT_SIZE, BITMAP_BYTES, BITMAP_BYTES, 0, 1, INODE_INLINE_BYTES, 1};
+
+// Single image volume. Segment segment_num of a kind is the fixed segment_size region at image_segment_base(), after the superblock. Inode and data segments are interleaved so both kinds can grow independently; regions of segments that were never created stay holes in the image file.
+static int image_fd = -1; // Descriptor of the image, -1 when the volume uses one file per segment
+
+static off_t image_segment_base(int kind, int segment_num)
+{
+    off_t reserved = superblock.reserved_size != 0 ? superblock.reserved_size : SUPERBLOCK_SIZE;
+    return reserved + ((off_t)segment_num * 2 + kind) * geometry.segment_size;
+}
 
-    // Generate segment filename
-    sprintf(filename, INODE_SEGMENT_NAME_PATTERN, segment_num);
+// File offset of block slot block_index of a segment
+static off_t segment_offset(segment_handle_t *segment, int block_index)
+{
+    return segment->base + (off_t)(block_index + 1) * geometry.block_size;
+}
 
-    // Try to open the file
-    file = fopen(filename, "r+b");
-    if (file == NULL)
+// Positioned I/O on a segment descriptor. pread/pwrite don't share a file offset, so these are safe to call from several threads on the same descriptor. Short transfers are retried until size bytes are moved or end of file is reached. Returns the number of bytes transferred or -1 on error.
+static ssize_t segment_pread(int fd, void *buffer, size_t size, off_t offset)
+{
+    size_t done = 0;
+    while (done < size)
     {
-        perror("Failed to open inode segment file");
-        return -1; // File not found
+        ssize_t n = pread(fd, (uint8_t *)buffer + done, size - done, offset + done);
+        STAT_INC(preads);
+        if (n < 0)
+        {
+            return -1;
+        }
+        if (n == 0)
+        {
+            break; // End of file
+        }
+        done += n;
     }
+    return done;
+}
 
-    // Read the bitmap from the file
-    if (fread(bitmap, sizeof(bitmap), 1, file) != 1)
+static ssize_t segment_pwrite(int fd, const void *buffer, size_t size, off_t offset)
+{
+    size_t done = 0;
+    while (done < size)
     {
-        fclose(file);
-        return -2; // Failed to read bitmap
+        ssize_t n = pwrite(fd, (const uint8_t *)buffer + done, size - done, offset + done);
+        STAT_INC(pwrites);
+        if (n <= 0)
+        {
+            return -1;
+        }
+        done += n;
     }
+    return done;
+}
 
-    // Check if the inode is used
-    if (bitmap[inode_index] == 0)
+// Vectored variants used for runs of adjacent blocks. The iovec array is consumed as data is transferred. segment_preadv stops at end of file, segment_pwritev retries short writes.
+static ssize_t segment_preadv(int fd, struct iovec *iov, int iovcnt, off_t offset)
+{
+    size_t done = 0;
+    while (iovcnt > 0)
     {
-        fclose(file);
-        return -2; // Inode not found
-    }
-
-    // Read the inode from the file
-    fseek(file, (inode_index + 1) * INODE_SIZE, SEEK_SET);
-    size_t read = fread(inode, sizeof(inode_t), 1, file);
-    fclose(file);
+        ssize_t n = preadv(fd, iov, iovcnt, offset + done);
+        STAT_INC(preads);
+        if (n < 0)
+        {
+            return -1;
+        }
+        if (n == 0)
+        {
+            break; // End of file
+        }
+        done += n;
 
-    if (read != 1)
-    {
-        return -2; // Failed to read inode
+        // Skip the vectors that are complete and trim the partially filled one
+        while (iovcnt > 0 && (size_t)n >= iov->iov_len)
+        {
+            n -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if (iovcnt > 0)
+        {
+            iov->iov_base = (uint8_t *)iov->iov_base + n;
+            iov->iov_len -= n;
+        }
     }
-
-    return 0; // Success
+    return done;
 }
 
-// read data block function that takes a datablock number and read the datablock from the segment file. If the datablock number is greater than 255 take divisor as a file name number and take the remainder as the datablock number. Read the segment file and read the datablock from the file. If the file is not found return -1. If the datablock is not found return -2. If the datablock is found return 0.
-int read_datablock(int datablock_number, datablock_t *datablock)
+static ssize_t segment_pwritev(int fd, struct iovec *iov, int iovcnt, off_t offset)
 {
-    uint8_t bitmap[BITMAP_BYTES];
-    FILE *file = NULL;
-    char filename[32];
-    int segment_num = datablock_number / 255;     // Calculate segment number
-    int datablock_index = datablock_number % 255; // Calculate datablock index
+    size_t done = 0;
+    while (iovcnt > 0)
+    {
+        ssize_t n = pwritev(fd, iov, iovcnt, offset + done);
+        STAT_INC(pwrites);
+        if (n <= 0)
+        {
+            return -1;
+        }
+        done += n;
 
-    // Generate segment filename
-    sprintf(filename, DATA_SEGMENT_NAME_PATTERN, segment_num);
+        while (iovcnt > 0 && (size_t)n >= iov->iov_len)
+        {
+            n -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if (iovcnt > 0)
+        {
+            iov->iov_base = (uint8_t *)iov->iov_base + n;
+            iov->iov_len -= n;
+        }
+    }
+    return done;
+}
 
-    // Try to open the file
-    file = fopen(filename, "r+b");
-    if (file == NULL)
+// Reserve the full extent of a newly created segment that starts at base
+static void preallocate_segment(int fd, off_t base)
+{
+#if USE_FALLOCATE
+    if (fallocate(fd, 0, base, geometry.segment_size) == 0)
     {
-        // perror("Failed to open data segment file");
-        return -1; // File not found
+        STAT_INC(fallocates);
     }
+#else
+    (void)fd;
+    (void)base;
+#endif
+}
+
+#if USE_MMAP_SEGMENTS
+// Map a freshly opened segment. The file is extended to cover the full segment_size of the segment first so that every block slot is backed by the mapping. On failure the segment keeps using pread/pwrite.
+static void map_segment(segment_handle_t *segment)
+{
+    int fd = segment->fd;
+    struct stat st;
 
-    // Read the bitmap from the file
-    if (fread(bitmap, sizeof(bitmap), 1, file) != 1)
+    if (fstat(fd, &st) != 0)
     {
-        fclose(file);
-        return -2; // Failed to read bitmap
+        return;
     }
 
-    // Check if the datablock is used
-    if (bitmap[datablock_index] == 0)
+    if (st.st_size < segment->base + geometry.segment_size && ftruncate(fd, segment->base + geometry.segment_size) != 0)
     {
-        fclose(file);
-        return -2; // Datablock not found
+        return;
     }
 
-    // Read the datablock from the file
-    fseek(file, (datablock_index + 1) * DATA_SIZE, SEEK_SET);
-    size_t read = fread(datablock, sizeof(datablock_t), 1, file);
-    fclose(file);
-
-    if (read != 1)
+    void *map = mmap(NULL, geometry.segment_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, segment->base);
+    if (map == MAP_FAILED)
     {
-        return -2; // Failed to read datablock
+        return;
     }
 
-    return 0; // Success
+    STAT_INC(segment_maps);
+    segment->map = map;
+    segment->dirty_start = geometry.segment_size;
+    segment->dirty_end = 0;
 }
+#endif
 
-// Create an inode and save it to the first available free block in an available segment
-int create_inode(inode_t *inode)
+// Function check_geometry that validates a block and segment size for the given superblock flags. Blocks must be a power of two of at least BLOCK_SIZE so that inode and directory records fit, and the bitmap of a segment must fit in its first block. Returns 0 if the geometry is usable and -1 otherwise.
+static int check_geometry(uint32_t block_size, uint32_t segment_size, uint32_t flags)
 {
-    uint8_t bitmap[BITMAP_BYTES];
-    FILE *file = NULL;
-    char filename[32];
-    int segment_num = 0;
-    int found_space = 0;
+    uint64_t max_blocks = (flags & SUPERBLOCK_PACKED_BITMAP) ? (uint64_t)block_size * 8 : block_size;
 
-    // Try segments until we find one with free space
-    while (!found_space)
+    if (block_size < BLOCK_SIZE || block_size > MAX_BLOCK_SIZE || (block_size & (block_size - 1)) != 0)
     {
-        // Generate segment filename
-        sprintf(filename, INODE_SEGMENT_NAME_PATTERN, segment_num);
-
-        // printf("Checking segment file %s...\n", filename);
+        fprintf(stderr, "Block size must be a power of two between %d and %d bytes\n", BLOCK_SIZE, MAX_BLOCK_SIZE);
+        return -1;
+    }
+    if (segment_size % block_size != 0 || segment_size / block_size < 2 || segment_size / block_size - 1 > max_blocks)
+    {
+        fprintf(stderr, "Segment size must be a multiple of the block size holding between 2 and %lu blocks\n", (unsigned long)max_blocks + 1);
+        return -1;
+    }
+    return 0;
+}
 
-        // Try to open the file
-        file = fopen(filename, "r+b");
-        if (file == NULL)
-        {
-            // File doesn't exist, create a new segment
-            file = fopen(filename, "w+b");
-            if (file == NULL)
-            {
-                perror("Failed to create inode segment file");
-                return -1;
-            }
+static void set_geometry(uint32_t block_size, uint32_t segment_size, uint32_t flags)
+{
+    geometry.block_size = block_size;
+    geometry.segment_size = segment_size;
+    geometry.blocks_per_segment = segment_size / block_size - 1;
+    geometry.packed_bitmap = (flags & SUPERBLOCK_PACKED_BITMAP) != 0;
+    geometry.bitmap_bytes = geometry.packed_bitmap ? (geometry.blocks_per_segment + 7) / 8 : geometry.blocks_per_segment;
+    geometry.inodes_per_block = (flags & SUPERBLOCK_COMPACT_INODES) ? block_size / COMPACT_INODE_SIZE : 1;
+    geometry.triple_indirect = !(flags & SUPERBLOCK_COMPACT_INODES) || (flags & SUPERBLOCK_COMPACT_TRIPLE_INDIRECT);
+    geometry.inode_map_bytes = !(flags & SUPERBLOCK_COMPACT_INODES) ? INODE_INLINE_BYTES : geometry.triple_indirect ? COMPACT_AREA_BYTES - sizeof(uint32_t) : COMPACT_AREA_BYTES;
+}
 
-            // Initialize new bitmap for this segment
-            memset(&bitmap, 0, BITMAP_BYTES);
+// Read and check the superblock stored at the start of fd, and adopt its geometry
+static int load_superblock(int fd)
+{
+    // Superblocks written before the flags field existed are shorter, the missing fields read as 0
+    memset(&superblock, 0, sizeof(superblock));
+    if (segment_pread(fd, &superblock, sizeof(superblock), 0) < (ssize_t)offsetof(superblock_t, flags) ||
+        memcmp(superblock.magic, SUPERBLOCK_MAGIC, sizeof(superblock.magic)) != 0)
+    {
+        fprintf(stderr, "Invalid superblock\n");
+        return -1;
+    }
+    if (check_geometry(superblock.block_size, superblock.segment_size, superblock.flags) < 0)
+    {
+        return -1;
+    }
 
-            fwrite(&bitmap, sizeof(bitmap), 1, file);
-            found_space = 1;
-        }
-        else
-        {
-            // Read the bitmap from existing segment
-            if (fread(bitmap, sizeof(bitmap), 1, file) != 1)
-            {
-                fclose(file);
-                segment_num++;
-                continue;
-            }
+    set_geometry(superblock.block_size, superblock.segment_size, superblock.flags);
+    return 0;
+}
 
-            // Check if there's free space
-            for (int i = 0; i < BITMAP_BYTES; i++)
-            {
-                if (bitmap[i] == 0)
-                {
-                    found_space = 1;
-                    break;
-                }
-            }
+// Write the superblock back to the start of its file
+static int write_superblock()
+{
+    return segment_pwrite(superblock_fd, &superblock, sizeof(superblock), 0) == sizeof(superblock) ? 0 : -1;
+}
 
-            if (!found_space)
-            {
-                fclose(file);
-                segment_num++;
-            }
-        }
-    }
+// Allocation summary, stored right after the superblock: the number of free block slots of every segment and the length of its largest run of free slots, entry segment_num * 2 + kind so both kinds can grow. Together with superblock.first_free it lets create_block and allocate_extent go straight to a segment with room instead of opening and scanning every segment from 0. The summary is a hint, the bitmaps stay authoritative: a wrong count is corrected when its segment is visited. Volumes without SUPERBLOCK_RUN_SUMMARY have a summary of free counts only, which is converted when it is loaded.
+#define SUMMARY_UNKNOWN UINT32_MAX
 
-    // Find an empty block in the bitmap
-    for (int i = 0; i < BITMAP_BYTES; i++)
-    {
-        if (bitmap[i] == 0)
-        { // Check if the block is free
-            // Mark the block as used
-            bitmap[i] = 1;
+typedef struct
+{
+    uint32_t free_count;  // Free block slots of the segment, SUMMARY_UNKNOWN if not counted
+    uint32_t largest_run; // Longest run of free slots, SUMMARY_UNKNOWN if the segment gained free slots since it was measured
+} summary_entry_t;
 
-            // printf("Current Bitmap: ");
-            // for (int j = 0; j < BITMAP_BYTES; j++)
-            // {
-            //     printf("%u ", bitmap[j]);
-            // }
-            // printf("\n");
+static struct
+{
+    summary_entry_t *entry; // Entry per segment and kind
+    uint32_t entries;       // Number of entries allocated in entry
+    int dirty;              // The summary or the superblock changed since they were written back
+} summary;
 
-            // Update the bitmap in the file
-            fseek(file, 0, SEEK_SET);
-            fwrite(&bitmap, sizeof(bitmap), 1, file);
+// Free-run index: per segment kind a max tree over the segments, leaf segment_num holding the longest free run the segment may have. That is the summary's largest run when it is known, else the free count, else a whole segment, so the index never rules out a segment that has room. alloc_search_next() uses it to find the next segment with a long enough run in O(log n) instead of scanning the summary and opening segments that turn out to be too fragmented. The index is rebuilt from the summary when the volume outgrows it.
+static struct
+{
+    uint32_t *tree; // tree[1] is the root, the children of node i are 2i and 2i + 1, leaves start at index leaves
+    uint32_t leaves; // Number of leaves, a power of two
+} free_index[2];
 
-            // Write the inode to the file
-            fseek(file, (i + 1) * INODE_SIZE, SEEK_SET);
-            size_t written = fwrite(inode, sizeof(inode_t), 1, file);
-            if (written != 1)
-            {
-                perror("Failed to write inode to file");
-                fclose(file);
-                return -1;
-            }
+#define FREE_INDEX_NONE UINT32_MAX
 
-            fclose(file);
-            // return i; // Return inode index for success
-            return (segment_num * 255) + i; // Return data index for success
-        }
+// Number of summary entries the volume has room for. Segments past it are not tracked and are scanned when visited.
+static uint64_t summary_capacity()
+{
+    if (image_fd >= 0)
+    {
+        return ((superblock.reserved_size != 0 ? superblock.reserved_size : SUPERBLOCK_SIZE) - SUMMARY_OFFSET) / sizeof(summary_entry_t);
     }
-
-    // Should never reach here because we already checked for free space
-    fclose(file);
-    return -1;
+    return UINT32_MAX;
 }
 
-int create_datablock(datablock_t *datablock)
+static uint32_t summary_get(int kind, uint32_t segment_num)
 {
-    uint8_t bitmap[BITMAP_BYTES];
-    FILE *file = NULL;
-    char filename[32];
-    int segment_num = 0;
-    int found_space = 0;
+    uint64_t entry = (uint64_t)segment_num * 2 + kind;
+    return entry < summary.entries ? summary.entry[entry].free_count : SUMMARY_UNKNOWN;
+}
 
-    // Try segments until we find one with free space
-    while (!found_space)
+// Longest free run segment segment_num may have, the value of its free-run index leaf
+static uint32_t free_index_value(int kind, uint32_t segment_num)
+{
+    uint64_t entry = (uint64_t)segment_num * 2 + kind;
+    if (entry >= summary.entries)
     {
-        // Generate segment filename
-        sprintf(filename, DATA_SEGMENT_NAME_PATTERN, segment_num);
-
-        // printf("Checking segment file %s...\n", filename);
-
-        // Try to open the file
-        file = fopen(filename, "r+b");
-        if (file == NULL)
-        {
-            // File doesn't exist, create a new segment
-            file = fopen(filename, "w+b");
-            if (file == NULL)
-            {
-                perror("Failed to create inode segment file");
-                return -1;
-            }
-
-            // Initialize new bitmap for this segment
-            memset(&bitmap, 0, BITMAP_BYTES);
+        return geometry.blocks_per_segment;
+    }
+    if (summary.entry[entry].largest_run != SUMMARY_UNKNOWN)
+    {
+        return summary.entry[entry].largest_run;
+    }
+    if (summary.entry[entry].free_count != SUMMARY_UNKNOWN)
+    {
+        return summary.entry[entry].free_count;
+    }
+    return geometry.blocks_per_segment;
+}
 
-            fwrite(&bitmap, sizeof(bitmap), 1, file);
-            found_space = 1;
-        }
-        else
-        {
-            // Read the bitmap from existing segment
-            if (fread(bitmap, sizeof(bitmap), 1, file) != 1)
-            {
-                fclose(file);
-                segment_num++;
-                continue;
-            }
+static void free_index_update(int kind, uint32_t segment_num)
+{
+    if (segment_num >= free_index[kind].leaves)
+    {
+        return; // Picked up when the index is rebuilt
+    }
 
-            // Check if there's free space
-            for (int i = 0; i < BITMAP_BYTES; i++)
-            {
-                if (bitmap[i] == 0)
-                {
-                    found_space = 1;
-                    break;
-                }
-            }
+    uint32_t *tree = free_index[kind].tree;
+    uint32_t node = free_index[kind].leaves + segment_num;
+    tree[node] = free_index_value(kind, segment_num);
+    for (node /= 2; node >= 1; node /= 2)
+    {
+        tree[node] = tree[2 * node] > tree[2 * node + 1] ? tree[2 * node] : tree[2 * node + 1];
+    }
+}
 
-            if (!found_space)
-            {
-                fclose(file);
-                segment_num++;
-            }
-        }
+// Build the free-run index of a kind from the summary, with room for at least segments leaves. Returns 0 on success and -1 if out of memory.
+static int free_index_build(int kind, uint32_t segments)
+{
+    uint32_t leaves = 64;
+    while (leaves < segments)
+    {
+        leaves *= 2;
     }
 
-    // Find an empty block in the bitmap
-    for (int i = 0; i < BITMAP_BYTES; i++)
+    uint32_t *tree = realloc(free_index[kind].tree, 2 * (size_t)leaves * sizeof(uint32_t));
+    if (tree == NULL)
     {
-        if (bitmap[i] == 0)
-        { // Check if the block is free
-            // Mark the block as used
-            bitmap[i] = 1;
+        return -1;
+    }
+    free_index[kind].tree = tree;
+    free_index[kind].leaves = leaves;
 
-            // printf("Current Bitmap: ");
-            // for (int j = 0; j < BITMAP_BYTES; j++)
-            // {
-            //     printf("%u ", bitmap[j]);
-            // }
-            // printf("\n");
+    for (uint32_t i = 0; i < leaves; i++)
+    {
+        tree[leaves + i] = i < segments ? free_index_value(kind, i) : 0;
+    }
+    for (uint32_t node = leaves - 1; node >= 1; node--)
+    {
+        tree[node] = tree[2 * node] > tree[2 * node + 1] ? tree[2 * node] : tree[2 * node + 1];
+    }
+    return 0;
+}
 
-            // Update the bitmap in the file
-            fseek(file, 0, SEEK_SET);
-            fwrite(&bitmap, sizeof(bitmap), 1, file);
+static uint32_t free_index_descend(const uint32_t *tree, uint32_t node, uint32_t node_start, uint32_t node_end, uint32_t start, uint32_t end, uint32_t length)
+{
+    if (node_end <= start || end <= node_start || tree[node] < length)
+    {
+        return FREE_INDEX_NONE;
+    }
+    if (node_end - node_start == 1)
+    {
+        return node_start;
+    }
 
-            // Write the inode to the file
-            fseek(file, (i + 1) * DATA_SIZE, SEEK_SET);
-            size_t written = fwrite(datablock, sizeof(datablock_t), 1, file);
-            if (written != 1)
-            {
-                perror("Failed to write inode to file");
-                fclose(file);
-                return -1;
-            }
+    uint32_t middle = node_start + (node_end - node_start) / 2;
+    uint32_t found = free_index_descend(tree, 2 * node, node_start, middle, start, end, length);
+    return found != FREE_INDEX_NONE ? found : free_index_descend(tree, 2 * node + 1, middle, node_end, start, end, length);
+}
 
-            fclose(file);
-            return (segment_num * 255) + i; // Return data index for success
-            // return i; // Return data index for success
-        }
+static uint32_t free_index_max_descend(const uint32_t *tree, uint32_t node, uint32_t node_start, uint32_t node_end, uint32_t start, uint32_t end)
+{
+    if (node_end <= start || end <= node_start)
+    {
+        return 0;
+    }
+    if (start <= node_start && node_end <= end)
+    {
+        return tree[node];
     }
 
-    // Should never reach here because we already checked for free space
-    fclose(file);
-    return -1;
+    uint32_t middle = node_start + (node_end - node_start) / 2;
+    uint32_t left = free_index_max_descend(tree, 2 * node, node_start, middle, start, end);
+    uint32_t right = free_index_max_descend(tree, 2 * node + 1, middle, node_end, start, end);
+    return left > right ? left : right;
 }
 
-// Function create_directoryblock that takes a directoryblock and create a directoryblock in the file system. The directoryblock is created same as the create_datablock function. The difference is that instead of storing the datablock it stores a directory_block. The function returns the index of the directoryblock.
-int create_directoryblock(directoryblock_t *directory_block)
+// Function free_index_max that returns the longest free run any segment in [start, end) of a kind may have
+static uint32_t free_index_max(int kind, uint32_t start, uint32_t end)
 {
-    uint8_t bitmap[BITMAP_BYTES];
-    FILE *file = NULL;
-    char filename[32];
-    int segment_num = 0;
-    int found_space = 0;
+    if (start >= end)
+    {
+        return 0;
+    }
+    if (end > free_index[kind].leaves && free_index_build(kind, end) < 0)
+    {
+        return geometry.blocks_per_segment;
+    }
+    return free_index_max_descend(free_index[kind].tree, 1, 0, free_index[kind].leaves, start, end);
+}
 
-    // Try segments until we find one with free space
-    while (!found_space)
+// Function free_index_find that returns the first segment in [start, end) of a kind that may have a free run of length slots, or FREE_INDEX_NONE. Segments the index cannot hold are always candidates.
+static uint32_t free_index_find(int kind, uint32_t start, uint32_t end, uint32_t length)
+{
+    if (start >= end)
     {
-        // Generate segment filename
-        sprintf(filename, DATA_SEGMENT_NAME_PATTERN, segment_num);
+        return FREE_INDEX_NONE;
+    }
+    if (end > free_index[kind].leaves && free_index_build(kind, end) < 0)
+    {
+        return start;
+    }
+    return free_index_descend(free_index[kind].tree, 1, 0, free_index[kind].leaves, start, end, length);
+}
 
-        // printf("Checking segment file %s...\n", filename);
+static void summary_set(int kind, uint32_t segment_num, uint32_t free_count)
+{
+    uint64_t entry = (uint64_t)segment_num * 2 + kind;
 
-        // Try to open the file
-        file = fopen(filename, "r+b");
-        if (file == NULL)
+    if (entry >= summary.entries)
+    {
+        if (entry >= summary_capacity())
         {
-            // File doesn't exist, create a new segment
-            file = fopen(filename, "w+b");
-            if (file == NULL)
-            {
-                perror("Failed to create inode segment file");
-                return -1;
-            }
-
-            // Initialize new bitmap for this segment
-            memset(&bitmap, 0, BITMAP_BYTES);
+            return;
+        }
 
-            fwrite(&bitmap, sizeof(bitmap), 1, file);
-            found_space = 1;
+        uint64_t entries = summary.entries > 0 ? summary.entries : 64;
+        while (entries <= entry)
+        {
+            entries *= 2;
         }
-        else
+        if (entries > summary_capacity())
         {
-            // Read the bitmap from existing segment
-            if (fread(bitmap, sizeof(bitmap), 1, file) != 1)
-            {
-                fclose(file);
-                segment_num++;
-                continue;
-            }
-
-            // Check if there's free space
-            for (int i = 0; i < BITMAP_BYTES; i++)
-            {
-                if (bitmap[i] == 0)
-                {
-                    found_space = 1;
-                    break;
-                }
-            }
+            entries = summary_capacity();
+        }
 
-            if (!found_space)
-            {
-                fclose(file);
-                segment_num++;
-            }
+        summary_entry_t *grown = realloc(summary.entry, entries * sizeof(summary_entry_t));
+        if (grown == NULL)
+        {
+            return;
+        }
+        for (uint64_t i = summary.entries; i < entries; i++)
+        {
+            grown[i].free_count = SUMMARY_UNKNOWN;
+            grown[i].largest_run = SUMMARY_UNKNOWN;
         }
+        summary.entry = grown;
+        summary.entries = entries;
     }
 
-    // Find an empty block in the bitmap
-    for (int i = 0; i < BITMAP_BYTES; i++)
+    // The largest run can't be longer than the free count
+    summary_entry_t *counts = &summary.entry[entry];
+    uint32_t largest_run = counts->largest_run != SUMMARY_UNKNOWN && counts->largest_run > free_count ? free_count : counts->largest_run;
+    if (counts->free_count != free_count || counts->largest_run != largest_run)
     {
-        if (bitmap[i] == 0)
-        { // Check if the block is free
-            // Mark the block as used
-            bitmap[i] = 1;
-
-            // printf("Current Bitmap: ");
-            // for (int j = 0; j < BITMAP_BYTES; j++)
-            // {
-            //     printf("%u ", bitmap[j]);
-            // }
-            // printf("\n");
-
-            // Update the bitmap in the file
-            fseek(file, 0, SEEK_SET);
-            fwrite(&bitmap, sizeof(bitmap), 1, file);
-
-            // Write the inode to the file
-            fseek(file, (i + 1) * DATA_SIZE, SEEK_SET);
-            size_t written = fwrite(directory_block, sizeof(directoryblock_t), 1, file);
-            if (written != 1)
-            {
-                perror("Failed to write inode to file");
-                fclose(file);
-                return -1;
-            }
-            fclose(file);
-            // Returning the overall index of the directory block
-            return (segment_num * 255) + i; // Return data index for success
-            // return i;
-        }
+        counts->free_count = free_count;
+        counts->largest_run = largest_run;
+        summary.dirty = 1;
+        free_index_update(kind, segment_num);
     }
-    // Should never reach here because we already checked for free space
-    fclose(file);
-    return -1;
 }
 
-// Function add_directoryentry_to_directoryblock that takes a directoryblock and update its array of directory entires. The function takes in directoryblock and a directory entry and adds that directory entry to the directoryblock. The function returns 0 on success and -1 on failure.
-
-int add_directoryentry_to_directoryblock(uint32_t directoryblock_index, directory_entry_t *entry)
+// Record the measured length of the largest free run of a segment
+static void summary_set_run(int kind, uint32_t segment_num, uint32_t largest_run)
 {
-    directoryblock_t directory_block;
-
-    // Read the existing directory block
-    int result = read_directory_block(directoryblock_index, &directory_block);
-    if (result < 0)
+    uint64_t entry = (uint64_t)segment_num * 2 + kind;
+    if (entry < summary.entries && summary.entry[entry].largest_run != largest_run)
     {
-        return result; // Failed to read the directory block
+        summary.entry[entry].largest_run = largest_run;
+        summary.dirty = 1;
+        free_index_update(kind, segment_num);
     }
+}
 
-    // Check if there's space for a new entry
-    for (int i = 0; i < BLOCK_SIZE / sizeof(directory_entry_t); i++)
+// Record that segment segment_num of a kind may have a free block slot, its largest free run may have grown
+static void summary_note_free(int kind, uint32_t segment_num)
+{
+    summary_set_run(kind, segment_num, SUMMARY_UNKNOWN);
+    if (segment_num < superblock.first_free[kind])
     {
-        if (directory_block.entries[i].inuse != 1)
-        {
-            // Add the new entry to the first empty slot
-            directory_block.entries[i] = *entry;
-
-            // Update the directory block in the file
-            uint8_t bitmap[BITMAP_BYTES];
-            FILE *file = NULL;
-            char filename[32];
-            int segment_num = directoryblock_index / 255;
-            int block_index = directoryblock_index % 255;
-
-            sprintf(filename, DATA_SEGMENT_NAME_PATTERN, segment_num);
-            file = fopen(filename, "r+b");
-            if (file == NULL)
-            {
-                return -1;
-            }
-
-            // Skip the bitmap
-            fseek(file, (block_index + 1) * BLOCK_SIZE, SEEK_SET);
-
-            // Write the updated directory block
-            if (fwrite(&directory_block, sizeof(directoryblock_t), 1, file) != 1)
-            {
-                fclose(file);
-                return -1;
-            }
-
-            fclose(file);
-
-            return 0; // Success
-        }
+        superblock.first_free[kind] = segment_num;
+        summary.dirty = 1;
     }
-
-    return -1; // Directory block is full
 }
 
-// Function create_directory that takes a directory name and create a directory in the file system. The directory is created by creating a datablock and writing the directory name to the datablock. The datablock is then saved to the first available free block in an available segment. The function returns the index of the datablock. The second paramter is the inode number of the parent directory. The function creates a directory entry in the parent directory for the new directory. If the second parameter is not provided then the parent directory is set to have inode number 0. The function returns the index of the datablock.
-// It creates a directory entry in the parent directory for the new directory. If the second parameter is not provided then the parent directory is set to have inode number 0. The function returns the index of the datablock.
-int create_directory(const char *directory_name, int parent_inode_number)
+// Write the superblock and the allocation summary back if they changed
+static void sync_summary()
 {
-    directoryblock_t directory_block;
-    uint32_t block_count = 0;
+    if (!summary.dirty || superblock_fd < 0)
+    {
+        return;
+    }
 
-    // Create a new directory entry
-    directory_entry_t new_entry;
-    strncpy(new_entry.name, directory_name, sizeof(new_entry.name) - 1);
-    new_entry.name[sizeof(new_entry.name) - 1] = '\0'; // Ensure null termination
-    new_entry.inode_number = 0;                        // Placeholder for inode number
-    new_entry.type = FILE_TYPE_DIRECTORY;              // Directory type
-    new_entry.inuse = 1;                               // Mark as in-use
+    write_superblock();
+    if (summary.entries > 0)
+    {
+        segment_pwrite(superblock_fd, summary.entry, summary.entries * sizeof(summary_entry_t), SUMMARY_OFFSET);
+    }
+    summary.dirty = 0;
+}
 
-    // Initialize the directory block
-    memset(&directory_block, 0, sizeof(directoryblock_t));
-    memcpy(&directory_block.entries[0], &new_entry, sizeof(directory_entry_t));
+static int load_summary();
 
-    // Create a datablock and store its index
-    int directoryblock_index = create_directoryblock(&directory_block);
-    if (directoryblock_index < 0)
+// Function open_volume that opens the volume in the current directory and loads its geometry from the superblock. An existing image file is used first, otherwise the volume is one file per segment with its superblock in SUPERBLOCK_FILE_NAME. Volumes written before superblocks existed get one with the default geometry. A new volume is formatted with block_size and segment_size (0 for the defaults), as an image if USE_IMAGE_FILE is set. Returns 0 on success and -1 on failure.
+int open_volume(uint32_t block_size, uint32_t segment_size)
+{
+    int format = block_size != 0 || segment_size != 0;
+    block_size = block_size != 0 ? block_size : BLOCK_SIZE;
+    segment_size = segment_size != 0 ? segment_size : SEGMENT_SIZE;
+
+    int fd = open(IMAGE_FILE_NAME, O_RDWR);
+    int image = fd >= 0;
+    if (!image)
     {
-        perror("Failed to create datablock");
-        return -1;
+        fd = open(SUPERBLOCK_FILE_NAME, O_RDWR);
     }
 
-    // Save the datablock index in the parent inode's direct blocks
-    if (parent_inode_number > 0)
+    if (fd >= 0)
     {
-        inode_t parent_inode;
-        if (read_inode(parent_inode_number, &parent_inode) != 0)
+        STAT_INC(segment_opens);
+        if (format)
         {
-            perror("Failed to read parent inode");
-            return -1;
+            fprintf(stderr, "Block and segment sizes only apply when a new volume is formatted\n");
         }
 
-        for (int i = 0; i < MAX_DIRECT_BLOCKS; i++)
+        if (load_superblock(fd) < 0)
         {
-            if (parent_inode.direct_blocks[i] == 0)
-            {
-                parent_inode.direct_blocks[i] = directoryblock_index;
-                break;
-            }
+            close(fd);
+            return -1;
         }
-
-        // Update the parent inode in the segment file
-        FILE *segment_file = fopen(INODE_SEGMENT_NAME_PATTERN, "r+b");
-        if (segment_file == NULL)
+        superblock_fd = fd;
+        if (image)
         {
-            perror("Failed to open segment file");
-            return -1;
+            image_fd = fd;
         }
-        fseek(segment_file, (parent_inode_number + 1) * INODE_SIZE, SEEK_SET);
-        fwrite(&parent_inode, sizeof(inode_t), 1, segment_file);
-        fclose(segment_file);
+        return load_summary();
     }
 
-    return directoryblock_index; // Return the index of the created datablock
-}
-
-// Function that takes a file path and create a inode for that file and save it to the first available free block in an available segment and then create a datablock for that file and save it to the first available free block in an available segment. Save the datablock index in the inode.direct_blocks[0].
-int create_inode_for_file(const char *file_path)
-{
-    inode_t inode;
+    int legacy = access("inodeseg0", F_OK) == 0 || access("dataseg0", F_OK) == 0;
+    // Volumes without a superblock use byte bitmaps and whole-block inodes
+    uint32_t flags = (USE_PACKED_BITMAPS ? SUPERBLOCK_PACKED_BITMAP : 0) | (USE_COMPACT_INODES ? SUPERBLOCK_COMPACT_INODES | SUPERBLOCK_COMPACT_TRIPLE_INDIRECT : 0);
+    if (legacy)
+    {
+        if (format)
+        {
+            fprintf(stderr, "Block and segment sizes only apply when a new volume is formatted\n");
+        }
+        block_size = BLOCK_SIZE;
+        segment_size = SEGMENT_SIZE;
+        flags = 0;
+    }
+    else if (check_geometry(block_size, segment_size, flags) < 0)
+    {
+        return -1;
+    }
 
-    inode.type = FILE_TYPE_REGULAR; // Regular file
-    inode.single_indirect = MAX_UNIT_32;
-    inode.double_indirect = MAX_UNIT_32;
+    memset(&superblock, 0, sizeof(superblock));
+    memcpy(superblock.magic, SUPERBLOCK_MAGIC, sizeof(superblock.magic));
+    superblock.block_size = block_size;
+    superblock.segment_size = segment_size;
+    superblock.flags = flags;
+    set_geometry(block_size, segment_size, flags);
 
-    datablock_t datablock;
-    uint32_t block_count = 0;
+    image = USE_IMAGE_FILE && !legacy;
+    if (image)
+    {
+        superblock.reserved_size = IMAGE_RESERVED_SIZE;
+    }
 
-    // Reading the actual file data
-    FILE *file = fopen(file_path, "rb");
-    if (file == NULL)
+    fd = open(image ? IMAGE_FILE_NAME : SUPERBLOCK_FILE_NAME, O_RDWR | O_CREAT | O_EXCL, 0666);
+    if (fd < 0)
     {
-        perror("Failed to open file");
+        perror("Failed to create superblock");
         return -1;
     }
+    STAT_INC(segment_opens);
 
-    // Get file size
-    fseek(file, 0, SEEK_END);
-    inode.size = ftell(file);
-    fseek(file, 0, SEEK_SET);
-
-    // printf("File Size: %lu\n", inode.size);
-    // printf("MAX_DIRECT_BLOCKS: %d\n", MAX_DIRECT_BLOCKS);
-
-    // Calculate how many blocks we need
-    block_count = (inode.size + BLOCK_SIZE - 1) / BLOCK_SIZE; // Ceiling division
+    superblock_fd = fd;
+    if (image)
+    {
+        image_fd = fd;
+    }
 
-    // File too large for direct blocks or single indirect blocks
-    if ((USE_SINGLE_INDIRECT && block_count > MAX_DIRECTORY_ENTRIES) || (!USE_SINGLE_INDIRECT && block_count > MAX_DIRECT_BLOCKS))
+    // A new volume starts with an empty summary, a legacy one has its summary built from the bitmaps
+    if (!legacy)
+    {
+        superblock.flags |= SUPERBLOCK_ALLOC_SUMMARY | SUPERBLOCK_RUN_SUMMARY;
+    }
+    if (write_superblock() < 0)
     {
+        return -1;
+    }
+    return load_summary();
+}
 
-        // Implement doubly indirect blocks here, in this case the data blocks will be stored in a directory block and collection of 128 directory block will be stored in another indirect_second of the inode
+// Function get_segment that returns the open handle of a segment, opening it on first use. If the segment doesn't exist and create is set, a new segment with an empty bitmap is created. For image volumes the handle shares the image descriptor and points at the segment's region. Returns NULL if the segment doesn't exist or can't be opened.
+segment_handle_t *get_segment(int kind, int segment_num, int create)
+{
+    segment_table_t *table = &segment_tables[kind];
 
-        // Handle large files with double indirect blocks
-        inode.type = FILE_TYPE_REGULAR;
+    if (segment_num < 0)
+    {
+        return NULL;
+    }
 
-        // Allocate a double indirect block to store pointers to indirect blocks
-        directoryblock_t double_indirect_block;
-        memset(&double_indirect_block, 0, sizeof(directoryblock_t));
+    if (segment_num < table->capacity && table->segments[segment_num].fd >= 0)
+    {
+        return &table->segments[segment_num];
+    }
 
-        // Set up all entries in the double indirect block to be empty initially
-        for (int i = 0; i < MAX_DIRECTORY_ENTRIES; i++)
+    // Grow the table so that segment_num has a slot
+    if (segment_num >= table->capacity)
+    {
+        int new_capacity = table->capacity > 0 ? table->capacity : 16;
+        while (new_capacity <= segment_num)
         {
-            double_indirect_block.entries[i].inuse = 0;
-            double_indirect_block.entries[i].inode_number = MAX_UNIT_32;
-            double_indirect_block.entries[i].type = FILE_TYPE_DATA_L2;
-            strncpy(double_indirect_block.entries[i].name, "", sizeof(double_indirect_block.entries[i].name) - 1);
-            double_indirect_block.entries[i].name[sizeof(double_indirect_block.entries[i].name) - 1] = '\0';
+            new_capacity *= 2;
         }
 
-        // Create the double indirect block and store its index
-        int double_indirect_block_index = create_directoryblock(&double_indirect_block);
-        if (double_indirect_block_index < 0)
+        segment_handle_t *segments = realloc(table->segments, new_capacity * sizeof(segment_handle_t));
+        if (segments == NULL)
         {
-            fprintf(stderr, "Failed to create double indirect block\n");
-            fclose(file);
-            return -1;
+            return NULL;
         }
+        for (int i = table->capacity; i < new_capacity; i++)
+        {
+            memset(&segments[i], 0, sizeof(segment_handle_t));
+            segments[i].fd = -1;
+        }
+        table->segments = segments;
+        table->capacity = new_capacity;
+    }
 
-        // Store the double indirect block index
-        inode.double_indirect = double_indirect_block_index;
-
-        // Read file data in chunks and create datablocks
-        int total_chunks_created = 0;
-        int indirect_blocks_created = 0;
-        directoryblock_t current_indirect_block;
-        int current_indirect_block_index = -1;
-        int chunks_in_current_block = 0;
-
-        for (uint32_t i = 0; i < block_count; i++)
+    int fd;
+    off_t base = 0;
+    if (image_fd >= 0)
+    {
+        fd = image_fd;
+        base = image_segment_base(kind, segment_num);
+        if ((uint32_t)segment_num >= superblock.segment_count[kind])
         {
-            // Check if we need a new indirect block
-            if (chunks_in_current_block == 0 || chunks_in_current_block >= MAX_DIRECTORY_ENTRIES)
+            if (!create)
             {
-                // Check if we've exceeded the maximum number of indirect blocks
-                if (indirect_blocks_created >= MAX_DIRECTORY_ENTRIES)
-                {
-                    fprintf(stderr, "File too large even for double indirect blocks\n");
-                    fclose(file);
-                    return -1;
-                }
-
-                // Create a new indirect block
-                memset(&current_indirect_block, 0, sizeof(directoryblock_t));
-                for (int j = 0; j < MAX_DIRECTORY_ENTRIES; j++)
-                {
-                    current_indirect_block.entries[j].inuse = 0;
-                    current_indirect_block.entries[j].inode_number = MAX_UNIT_32;
-                    current_indirect_block.entries[j].type = FILE_TYPE_DATA_L1;
-                    strncpy(current_indirect_block.entries[j].name, "", sizeof(current_indirect_block.entries[j].name) - 1);
-                    current_indirect_block.entries[j].name[sizeof(current_indirect_block.entries[j].name) - 1] = '\0';
-                }
-
-                current_indirect_block_index = create_directoryblock(&current_indirect_block);
-                if (current_indirect_block_index < 0)
-                {
-                    fprintf(stderr, "Failed to create indirect block\n");
-                    fclose(file);
-                    return -1;
-                }
-
-                // Add this indirect block to the double indirect block
-                directory_entry_t indirect_block_entry;
-                indirect_block_entry.inuse = 1;
-                indirect_block_entry.type = FILE_TYPE_DATA_L1;
-                indirect_block_entry.inode_number = current_indirect_block_index;
-                sprintf(indirect_block_entry.name, "indirect%d", indirect_blocks_created);
-
-                if (add_directoryentry_to_directoryblock(double_indirect_block_index, &indirect_block_entry) < 0)
-                {
-                    fprintf(stderr, "Failed to add entry to double indirect block\n");
-                    fclose(file);
-                    return -1;
-                }
-
-                indirect_blocks_created++;
-                chunks_in_current_block = 0;
+                return NULL;
             }
 
-            // Clear the datablock
-            memset(&datablock, 0, sizeof(datablock_t));
-
-            // Read up to BLOCK_SIZE bytes into the datablock
-            size_t bytes_read = fread(datablock.data, 1, BLOCK_SIZE, file);
-
-            // Create a datablock and store its index
-            int datablock_index = create_datablock(&datablock);
-            if (datablock_index < 0)
+            // Claim the region with an empty bitmap. Regions skipped over stay holes and read back as empty segments.
+            uint8_t bitmap[geometry.bitmap_bytes];
+            memset(bitmap, 0, sizeof(bitmap));
+            preallocate_segment(fd, base);
+            if (segment_pwrite(fd, bitmap, sizeof(bitmap), base) < 0)
             {
-                fprintf(stderr, "Failed to create datablock\n");
-                fclose(file);
-                return -1;
+                return NULL;
             }
-
-            // Create directory entry for this chunk
-            directory_entry_t chunk_entry;
-            chunk_entry.inuse = 1;
-            chunk_entry.type = FILE_TYPE_DATA_L1;
-            chunk_entry.inode_number = datablock_index;
-            sprintf(chunk_entry.name, "chunk%d", chunks_in_current_block);
-
-            // Add the entry to the current indirect block
-            if (add_directoryentry_to_directoryblock(current_indirect_block_index, &chunk_entry) < 0)
+            superblock.segment_count[kind] = segment_num + 1;
+            if (write_superblock() < 0)
             {
-                fprintf(stderr, "Failed to add entry to indirect block\n");
-                fclose(file);
-                return -1;
+                return NULL;
             }
-
-            total_chunks_created++;
-            chunks_in_current_block++;
         }
-        // File is too large for direct blocks but fits in single indirect blocks
-        // Implement single indirect blocks here
-
-        // fprintf(stderr, "File too large for direct blocks or single indirect blocks\n");
-        // fclose(file);
-        // return -1;
     }
     else
     {
-        if (USE_SINGLE_INDIRECT)
-        {
-            // Handle large files with single indirect blocks
-            inode.type = FILE_TYPE_REGULAR;
-
-            // Allocate a directory block for indirect references
-            directoryblock_t indirect_block;
-            memset(&indirect_block, 0, sizeof(directoryblock_t));
-
-            // Set up all the directory entries to be empty initially
-            for (int i = 0; i < MAX_DIRECTORY_ENTRIES; i++)
-            {
-                indirect_block.entries[i].inuse = 0;
-                indirect_block.entries[i].inode_number = MAX_UNIT_32;
-                indirect_block.entries[i].type = FILE_TYPE_DATA_L1;
-                strncpy(indirect_block.entries[i].name, "", sizeof(indirect_block.entries[i].name) - 1);
-                indirect_block.entries[i].name[sizeof(indirect_block.entries[i].name) - 1] = '\0'; // Ensure null termination
-            }
+        char filename[32];
+        sprintf(filename, kind == SEGMENT_KIND_INODE ? INODE_SEGMENT_NAME_PATTERN : DATA_SEGMENT_NAME_PATTERN, segment_num);
 
-            // Create the indirect block and store its index
-            int indirect_block_index = create_directoryblock(&indirect_block);
-            if (indirect_block_index < 0)
+        fd = open(filename, O_RDWR);
+        if (fd < 0 && create)
+        {
+            // File doesn't exist, create a new segment with an empty bitmap
+            fd = open(filename, O_RDWR | O_CREAT | O_TRUNC, 0666);
+            if (fd >= 0)
             {
-                fprintf(stderr, "Failed to create indirect block\n");
-                fclose(file);
-                return -1;
+                uint8_t bitmap[geometry.bitmap_bytes];
+                memset(bitmap, 0, sizeof(bitmap));
+                preallocate_segment(fd, 0);
+                segment_pwrite(fd, bitmap, sizeof(bitmap), 0);
             }
+        }
 
-            // Store the indirect block index
-            inode.single_indirect = indirect_block_index;
+        if (fd < 0)
+        {
+            return NULL;
+        }
+        STAT_INC(segment_opens);
+    }
 
-            // Read file data in chunks and create datablocks
-            int chunks_created = 0;
-            for (uint32_t i = 0; i < block_count; i++)
-            {
+    segment_handle_t *segment = &table->segments[segment_num];
+    memset(segment, 0, sizeof(segment_handle_t));
+    segment->fd = fd;
+    segment->base = base;
+#if USE_MMAP_SEGMENTS
+    map_segment(segment);
+#endif
 
-                // Skip direct blocks - we'll use indirect blocks for all chunks
-                if (chunks_created >= 128)
-                {
-                    fprintf(stderr, "File too large even for single indirect blocks\n");
-                    fclose(file);
-                    return -1;
-                }
+    // Mapped segments use the bitmap in place, the others keep a copy that is written back by sync_segments()
+    if (segment->map != NULL)
+    {
+        segment->bitmap = segment->map;
+    }
+    else
+    {
+        segment->bitmap = malloc(geometry.bitmap_bytes);
+        if (segment->bitmap != NULL && segment_pread(fd, segment->bitmap, geometry.bitmap_bytes, base) != geometry.bitmap_bytes)
+        {
+            free(segment->bitmap);
+            segment->bitmap = NULL;
+        }
+    }
 
-                // Clear the datablock
-                memset(&datablock, 0, sizeof(datablock_t));
+    return segment;
+}
 
-                // Read up to BLOCK_SIZE bytes into the datablock
-                size_t bytes_read = fread(datablock.data, 1, BLOCK_SIZE, file);
+// Record that a byte range of a mapped segment was modified so it gets written back by sync_segments()
+static void mark_segment_dirty(segment_handle_t *segment, size_t offset, size_t length)
+{
+    if (offset < segment->dirty_start)
+    {
+        segment->dirty_start = offset;
+    }
+    if (offset + length > segment->dirty_end)
+    {
+        segment->dirty_end = offset + length;
+    }
+}
 
-                // Create a datablock and store its index
-                int datablock_index = create_datablock(&datablock);
-                if (datablock_index < 0)
-                {
-                    fprintf(stderr, "Failed to create datablock\n");
-                    fclose(file);
-                    return -1;
-                }
+// Mark the bitmap of a segment as modified
+static void mark_bitmap_dirty(segment_handle_t *segment)
+{
+    segment->bitmap_changed = 1;
+    if (segment->map != NULL)
+    {
+        mark_segment_dirty(segment, 0, geometry.bitmap_bytes);
+    }
+    else
+    {
+        segment->bitmap_dirty = 1;
+    }
+}
 
-                // Create directory entry for this chunk
-                directory_entry_t chunk_entry;
-                chunk_entry.inuse = 1;
-                chunk_entry.type = FILE_TYPE_DATA_L1;
-                chunk_entry.inode_number = datablock_index;
-                sprintf(chunk_entry.name, "chunk%d", chunks_created);
+// Bitmap access. Volumes flagged SUPERBLOCK_PACKED_BITMAP keep one bit per block slot, bit index % 8 of byte index / 8, older volumes one byte per slot.
+static int bitmap_test(const uint8_t *bitmap, uint32_t index)
+{
+    if (geometry.packed_bitmap)
+    {
+        return (bitmap[index / 8] >> (index % 8)) & 1;
+    }
+    return bitmap[index] != 0;
+}
 
-                // Print the indirect_block_index and chunk entry
-                // printf("Indirect Block Index: %d, Chunk Entry: %d\n", indirect_block_index, chunk_entry.inode_number);
+static void bitmap_set(uint8_t *bitmap, uint32_t index, int used)
+{
+    if (!geometry.packed_bitmap)
+    {
+        bitmap[index] = used ? 1 : 0;
+    }
+    else if (used)
+    {
+        bitmap[index / 8] |= 1 << (index % 8);
+    }
+    else
+    {
+        bitmap[index / 8] &= ~(1 << (index % 8));
+    }
+}
 
-                // Add the entry to our indirect block
-                if (add_directoryentry_to_directoryblock(indirect_block_index, &chunk_entry) < 0)
-                {
-                    fprintf(stderr, "Failed to add entry to indirect block\n");
-                    fclose(file);
-                    return -1;
-                }
+// Mark length block slots from start used or free, whole bytes of a packed bitmap at once
+static void bitmap_set_range(uint8_t *bitmap, uint32_t start, uint32_t length, int used)
+{
+    uint32_t end = start + length;
+    if (!geometry.packed_bitmap)
+    {
+        memset(bitmap + start, used ? 1 : 0, length);
+        return;
+    }
 
-                chunks_created++;
-            }
+    while (start < end && start % 8 != 0)
+    {
+        bitmap_set(bitmap, start++, used);
+    }
+    uint32_t bytes = (end - start) / 8;
+    memset(bitmap + start / 8, used ? 0xFF : 0, bytes);
+    start += bytes * 8;
+    while (start < end)
+    {
+        bitmap_set(bitmap, start++, used);
+    }
+}
+
+// Number of free block slots in a segment bitmap
+static uint32_t bitmap_count_free(const uint8_t *bitmap)
+{
+    uint32_t used = 0;
+    for (uint32_t i = 0; i < geometry.bitmap_bytes; i++)
+    {
+        used += geometry.packed_bitmap ? __builtin_popcount(bitmap[i]) : bitmap[i] != 0;
+    }
+    return geometry.blocks_per_segment - used;
+}
+
+// Packed bitmaps at least this large skip full 16 byte chunks with SSE2 before the word scan
+#define BITMAP_SIMD_MIN_BYTES 64
+
+// Function bitmap_find_free that returns the index of the first free block slot in a segment bitmap, or -1 if the segment is full. Byte bitmaps are searched with memchr. Packed bitmaps are searched 64 bits at a time, the first free slot of a word being found with __builtin_ctzll.
+static int bitmap_find_free(const uint8_t *bitmap)
+{
+    if (!geometry.packed_bitmap)
+    {
+        const uint8_t *free_slot = memchr(bitmap, 0, geometry.blocks_per_segment);
+        return free_slot != NULL ? free_slot - bitmap : -1;
+    }
+
+    uint32_t bytes = geometry.bitmap_bytes;
+    uint32_t i = 0;
+
+#if defined(__SSE2__)
+    if (bytes >= BITMAP_SIMD_MIN_BYTES)
+    {
+        const __m128i full = _mm_set1_epi8(-1);
+        while (i + 16 <= bytes && _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(bitmap + i)), full)) == 0xFFFF)
+        {
+            i += 16;
         }
-        else
+    }
+#endif
+
+    for (; i < bytes; i += 8)
+    {
+        // Bytes past the end of the bitmap read as used
+        uint64_t word = UINT64_MAX;
+        memcpy(&word, bitmap + i, bytes - i < 8 ? bytes - i : 8);
+        word = ~le64toh(word);
+        if (word != 0)
         {
-            // Original code for small files (using direct blocks)
-            // prefill inode MAX_DIRECT_BLOCKS with 0
-            for (int i = 0; i < MAX_DIRECT_BLOCKS; i++)
-            {
-                inode.direct_blocks[i] = MAX_UNIT_32;
-            }
+            uint32_t index = i * 8 + __builtin_ctzll(word);
+            return index < geometry.blocks_per_segment ? (int)index : -1;
+        }
+    }
+    return -1;
+}
 
-            // Read file data in chunks and create datablocks
-            for (uint32_t i = 0; i < block_count; i++)
-            {
-                // Clear the datablock
-                memset(&datablock, 0, sizeof(datablock_t));
+// Function bitmap_next that returns the index of the first block slot at or after from whose state is used (1) or free (0), or blocks_per_segment if there is none. Packed bitmaps are searched a 64 bit word at a time.
+static uint32_t bitmap_next(const uint8_t *bitmap, uint32_t from, int used)
+{
+    uint32_t count = geometry.blocks_per_segment;
+    if (!geometry.packed_bitmap)
+    {
+        while (from < count && (bitmap[from] != 0) != used)
+        {
+            from++;
+        }
+        return from;
+    }
 
-                // Read up to BLOCK_SIZE bytes into the datablock
-                size_t bytes_read = fread(datablock.data, 1, BLOCK_SIZE, file);
+    while (from < count)
+    {
+        // Bytes past the end of the bitmap read as free, the result is clamped to count below
+        uint32_t i = from / 64 * 8;
+        uint64_t word = 0;
+        memcpy(&word, bitmap + i, geometry.bitmap_bytes - i < 8 ? geometry.bitmap_bytes - i : 8);
+        word = le64toh(word);
+        if (!used)
+        {
+            word = ~word;
+        }
+        word &= UINT64_MAX << (from % 64);
+        if (word != 0)
+        {
+            uint32_t index = i * 8 + __builtin_ctzll(word);
+            return index < count ? index : count;
+        }
+        from = (i + 8) * 8;
+    }
+    return count;
+}
 
-                // Create a datablock and store its index
-                int datablock_index = create_datablock(&datablock);
-                if (datablock_index < 0)
-                {
-                    perror("Failed to create datablock");
-                    fclose(file);
-                    return -1;
-                }
+// Function bitmap_find_run that returns the first slot of the first run of at least length free block slots in a segment bitmap, or -1 if the segment has no run that long
+static int bitmap_find_run(const uint8_t *bitmap, uint32_t length)
+{
+    uint32_t count = geometry.blocks_per_segment;
+    uint32_t start = bitmap_next(bitmap, 0, 0);
+    while (start < count)
+    {
+        uint32_t end = bitmap_next(bitmap, start, 1);
+        if (end - start >= length)
+        {
+            return start;
+        }
+        start = bitmap_next(bitmap, end, 0);
+    }
+    return -1;
+}
 
-                // Save datablock index in inode
-                inode.direct_blocks[i] = datablock_index;
-            }
+// Function bitmap_largest_run that returns the length of the longest run of free block slots in a segment bitmap
+static uint32_t bitmap_largest_run(const uint8_t *bitmap)
+{
+    uint32_t count = geometry.blocks_per_segment;
+    uint32_t largest = 0;
+    uint32_t start = bitmap_next(bitmap, 0, 0);
+    while (start < count && count - start > largest)
+    {
+        uint32_t end = bitmap_next(bitmap, start, 1);
+        if (end - start > largest)
+        {
+            largest = end - start;
         }
+        start = bitmap_next(bitmap, end, 0);
     }
+    return largest;
+}
 
-    // // prefill inode MAX_DIRECT_BLOCKS with 0
-    // for (int i = 0; i < MAX_DIRECT_BLOCKS; i++)
-    // {
-    //     inode.direct_blocks[i] = MAX_UNIT_32;
-    // }
+// Copy block slot block_index of a segment into block. Short reads past the end of an unmapped segment file are zero filled. Returns 0 on success and -1 on failure.
+static int segment_read(segment_handle_t *segment, int block_index, void *block, size_t size)
+{
+    if (segment->map != NULL)
+    {
+        memcpy(block, segment->map + (size_t)(block_index + 1) * geometry.block_size, size);
+        return 0;
+    }
 
-    // // Read file data in chunks and create datablocks
-    // for (uint32_t i = 0; i < block_count; i++)
-    // {
-    //     // Clear the datablock
-    //     memset(&datablock, 0, sizeof(datablock_t));
-
-    //     // Read up to BLOCK_SIZE bytes into the datablock
-    //     size_t bytes_read = fread(datablock.data, 1, BLOCK_SIZE, file);
-
-    //     // Create a datablock and store its index
-    //     int datablock_index = create_datablock(&datablock);
-    //     if (datablock_index < 0)
-    //     {
-    //         perror("Failed to create datablock");
-    //         fclose(file);
-    //         return -1;
-    //     }
-
-    //     // Save datablock index in inode
-    //     inode.direct_blocks[i] = datablock_index;
-    // }
+    ssize_t read = segment_pread(segment->fd, block, size, segment_offset(segment, block_index));
+    if (read <= 0)
+    {
+        return -1;
+    }
+    memset((uint8_t *)block + read, 0, size - read);
+    return 0;
+}
 
-    // printf("Total Block Count %d\n", block_count);
+// Bounded LRU buffer cache of whole blocks keyed by (segment kind, block number). Reads are served from the cache when possible and writes only mark the cached block dirty; dirty blocks are written back when they are evicted or when the operation ends in sync_segments(). A slot of a mapped segment points at the block inside the mapping instead of holding a copy, so writing it back only marks the range for msync.
+typedef struct
+{
+    int kind;          // Segment kind of the cached block
+    int block_number;  // Overall block number, -1 for an empty slot
+    int dirty;         // Block was modified and must be written back
+    int prev;          // LRU list links, most recently used first
+    int next;
+    int hash_next;     // Next slot in the same hash bucket
+    uint8_t *data;     // The cached block, either buffer or its slot in the segment mapping
+    uint8_t *buffer;   // One block of the volume's block size, used for segments that aren't mapped
+} cache_slot_t;
+
+static cache_slot_t block_cache[BLOCK_CACHE_BLOCKS];
+static int cache_buckets[BLOCK_CACHE_BUCKETS];
+static int cache_lru_head = -1;
+static int cache_lru_tail = -1;
+static int cache_initialized = 0;
+
+static int cache_bucket(int kind, int block_number)
+{
+    return ((unsigned)block_number * 2 + kind) % BLOCK_CACHE_BUCKETS;
+}
 
-    // Print the inode.direct_blocks that was going to be written to the file
-    // printf("Inode Direct Blocks: ");
-    // for (int i = 0; i < block_count; i++)
-    // {
-    //     printf("%u ", inode.direct_blocks[i]);
-    // }
-    // printf("\n");
+static void cache_lru_unlink(int slot)
+{
+    cache_slot_t *entry = &block_cache[slot];
 
-    fclose(file);
+    if (entry->prev >= 0)
+        block_cache[entry->prev].next = entry->next;
+    else
+        cache_lru_head = entry->next;
 
-    //  inode.triple_indirect = 0;
-    // for (int i = 0; i < MAX_DIRECT_BLOCKS; i++)
-    // {
-    //     inode.direct_blocks[i] = 0; // Initialize direct blocks
-    // }
-    // Create inode and datablock
+    if (entry->next >= 0)
+        block_cache[entry->next].prev = entry->prev;
+    else
+        cache_lru_tail = entry->prev;
+}
 
-    int inode_index = create_inode(&inode);
-    if (inode_index < 0)
+static void cache_lru_push_front(int slot)
+{
+    block_cache[slot].prev = -1;
+    block_cache[slot].next = cache_lru_head;
+    if (cache_lru_head >= 0)
+        block_cache[cache_lru_head].prev = slot;
+    cache_lru_head = slot;
+    if (cache_lru_tail < 0)
+        cache_lru_tail = slot;
+}
+
+static void cache_lru_push_back(int slot)
+{
+    block_cache[slot].next = -1;
+    block_cache[slot].prev = cache_lru_tail;
+    if (cache_lru_tail >= 0)
+        block_cache[cache_lru_tail].next = slot;
+    cache_lru_tail = slot;
+    if (cache_lru_head < 0)
+        cache_lru_head = slot;
+}
+
+static int cache_init()
+{
+    uint8_t *data = malloc((size_t)BLOCK_CACHE_BLOCKS * geometry.block_size);
+    if (data == NULL)
     {
-        perror("Failed to create inode");
         return -1;
     }
 
-    // printf("Inode Index: %d\n", inode_index);
-
-    // // Update inode in the segment file
-    // FILE *segment_file = fopen(INODE_SEGMENT_NAME_PATTERN, "r+b");
-    // if (segment_file == NULL)
-    // {
-    //     perror("Failed to open segment file");
-    //     return -1;
-    // }
-    // fseek(segment_file, (inode_index + 1) * INODE_SIZE, SEEK_SET);
-    // fwrite(&inode, sizeof(inode_t), 1, segment_file);
-    // fclose(segment_file);
-    return inode_index;
+    for (int i = 0; i < BLOCK_CACHE_BUCKETS; i++)
+    {
+        cache_buckets[i] = -1;
+    }
+    for (int i = 0; i < BLOCK_CACHE_BLOCKS; i++)
+    {
+        block_cache[i].block_number = -1;
+        block_cache[i].dirty = 0;
+        block_cache[i].hash_next = -1;
+        block_cache[i].buffer = data + (size_t)i * geometry.block_size;
+        cache_lru_push_back(i);
+    }
+    cache_initialized = 1;
+    return 0;
 }
 
-int find_entry_in_directory(directoryblock_t *dir_block, const char *name, directory_entry_t **found_entry)
+static int cache_find(int kind, int block_number)
 {
-    for (int i = 0; i < MAX_DIRECTORY_ENTRIES; i++)
+    if (!cache_initialized && cache_init() < 0)
     {
-        if (dir_block->entries[i].inuse == 1 && strcmp(dir_block->entries[i].name, name) == 0)
+        return -1;
+    }
+
+    for (int slot = cache_buckets[cache_bucket(kind, block_number)]; slot >= 0; slot = block_cache[slot].hash_next)
+    {
+        if (block_cache[slot].block_number == block_number && block_cache[slot].kind == kind)
         {
-            *found_entry = &dir_block->entries[i];
-            return i; // Return index if found
+            return slot;
         }
     }
-    *found_entry = NULL;
-    return -1; // Not found
+    return -1;
 }
 
-// Split a path into segments and return the count of segments
-int split_path(const char *path, char *segments[], int max_segments)
+// Write a dirty cached block back to its segment. Dirty blocks cached right before and after it in the same segment are written back with it as one run, using a single pwritev for unmapped segments and a single msync range for mapped ones.
+static int cache_write_back(int slot)
 {
-    char path_copy[256]; // Create a copy since strtok modifies the string
-    strncpy(path_copy, path, sizeof(path_copy) - 1);
-    path_copy[sizeof(path_copy) - 1] = '\0'; // Ensure null termination
+    cache_slot_t *entry = &block_cache[slot];
+    int kind = entry->kind;
+    int segment_num = entry->block_number / geometry.blocks_per_segment;
+    int base = segment_num * geometry.blocks_per_segment;
+    uint32_t first = entry->block_number % geometry.blocks_per_segment;
+    uint32_t last = first;
+    int run[BLOCK_CACHE_BLOCKS];
+    struct iovec iov[BLOCK_CACHE_BLOCKS];
+
+    segment_handle_t *segment = get_segment(kind, segment_num, 0);
+    if (segment == NULL)
+    {
+        return -1;
+    }
 
-    int segment_count = 0;
-    char *segment = strtok(path_copy, "/");
+    // Extend the run over adjacent dirty blocks in both directions
+    int neighbour;
+    while (first > 0 && (neighbour = cache_find(kind, base + first - 1)) >= 0 && block_cache[neighbour].dirty)
+    {
+        first--;
+    }
+    while (last < geometry.blocks_per_segment - 1 && (neighbour = cache_find(kind, base + last + 1)) >= 0 && block_cache[neighbour].dirty)
+    {
+        last++;
+    }
 
-    while (segment != NULL && segment_count < max_segments)
+    int count = last - first + 1;
+    for (int i = 0; i < count; i++)
     {
-        segments[segment_count++] = strdup(segment);
-        segment = strtok(NULL, "/");
+        run[i] = cache_find(kind, base + first + i);
+        iov[i].iov_base = block_cache[run[i]].data;
+        iov[i].iov_len = geometry.block_size;
     }
-    segments[segment_count] = NULL;
 
-    return segment_count;
+    if (segment->map != NULL)
+    {
+        // The blocks were modified in place, only their range of the mapping is left to sync
+        mark_segment_dirty(segment, (size_t)(first + 1) * geometry.block_size, (size_t)count * geometry.block_size);
+    }
+    else if (segment_pwritev(segment->fd, iov, count, segment_offset(segment, first)) < 0)
+    {
+        return -1;
+    }
+
+    for (int i = 0; i < count; i++)
+    {
+        block_cache[run[i]].dirty = 0;
+        STAT_INC(cache_writebacks);
+    }
+    return 0;
 }
 
-// Function to extract a file from the file system. The function takes a path as input and extracts the file from the file system. The function returns 0 on success and -1 on failure.
-int extract_file(const char *path, int verbose)
+// Remove a slot from its hash chain and mark it empty, without writing it back
+static void cache_evict(int slot)
 {
-    char *path_segments[256];
-    int segment_count = split_path(path, path_segments, 256);
+    cache_slot_t *entry = &block_cache[slot];
+    int *link = &cache_buckets[cache_bucket(entry->kind, entry->block_number)];
 
-    // Start with root inode (inode 0)
-    int current_inode_index = 0;
-    inode_t current_inode;
-    directoryblock_t dir_block;
+    while (*link != slot)
+    {
+        link = &block_cache[*link].hash_next;
+    }
+    *link = entry->hash_next;
 
-    // Traverse the path segments except the last one (which is the file)
-    for (int i = 0; i < segment_count; i++)
+    entry->block_number = -1;
+    entry->dirty = 0;
+    entry->hash_next = -1;
+}
+
+// Function cache_get that returns the cache slot holding a block, loading it from the segment on a miss when load is set. The least recently used block is evicted (and written back if dirty) to make room. Returns -1 on failure.
+static int cache_get(int kind, int block_number, segment_handle_t *segment, int load)
+{
+    int slot = cache_find(kind, block_number);
+    if (slot >= 0)
     {
-        // Read the current inode
-        if (read_inode(current_inode_index, &current_inode) < 0)
+        STAT_INC(cache_hits);
+        cache_lru_unlink(slot);
+        cache_lru_push_front(slot);
+        return slot;
+    }
+
+    STAT_INC(cache_misses);
+    slot = cache_lru_tail;
+    if (slot < 0)
+    {
+        return -1;
+    }
+    cache_slot_t *entry = &block_cache[slot];
+    if (entry->block_number >= 0)
+    {
+        if (entry->dirty && cache_write_back(slot) < 0)
         {
-            fprintf(stderr, "Failed to read inode at index %d\n", current_inode_index);
             return -1;
         }
+        cache_evict(slot);
+    }
 
-        // Make sure it's a directory (except for the last segment which could be a file)
-        if (i < segment_count - 1 && current_inode.type != FILE_TYPE_DIRECTORY)
+    if (segment->map != NULL)
+    {
+        entry->data = segment->map + (size_t)(block_number % geometry.blocks_per_segment + 1) * geometry.block_size;
+    }
+    else
+    {
+        entry->data = entry->buffer;
+        if (load && segment_read(segment, block_number % geometry.blocks_per_segment, entry->data, geometry.block_size) < 0)
         {
-            fprintf(stderr, "Path component %s is not a directory\n", path_segments[i]);
             return -1;
         }
+    }
 
-        // For directories, look through direct blocks for the directory block
-        int found_next_segment = 0;
-        for (int j = 0; j < MAX_DIRECT_BLOCKS; j++)
-        {
-            // TODO: Remove the ==0 check as all inode will be prefilled with MAX_UNIT_32
-            if (current_inode.direct_blocks[j] == MAX_UNIT_32 ||
-                current_inode.direct_blocks[j] == 0)
-            {
-                continue;
-            }
+    entry->kind = kind;
+    entry->block_number = block_number;
+    entry->dirty = 0;
+    int bucket = cache_bucket(kind, block_number);
+    entry->hash_next = cache_buckets[bucket];
+    cache_buckets[bucket] = slot;
 
-            // Read directory block
-            if (read_directory_block(current_inode.direct_blocks[j], &dir_block) < 0)
-            {
-                fprintf(stderr, "Failed to read directory block %u\n", current_inode.direct_blocks[j]);
-                continue;
-            }
+    cache_lru_unlink(slot);
+    cache_lru_push_front(slot);
+    return slot;
+}
 
-            // Search for the next path segment in this directory block
-            for (int k = 0; k < MAX_DIRECTORY_ENTRIES; k++)
-            {
-                if (dir_block.entries[k].inuse == 1 &&
-                    strcmp(dir_block.entries[k].name, path_segments[i]) == 0)
-                {
-                    // Found the entry for the next path segment
-                    current_inode_index = dir_block.entries[k].inode_number;
-                    found_next_segment = 1;
-                    break;
-                }
-            }
+// Drop a block from the cache without writing it back, used when the block is freed
+static void cache_discard(int kind, int block_number)
+{
+    int slot = cache_find(kind, block_number);
+    if (slot >= 0)
+    {
+        cache_evict(slot);
+        cache_lru_unlink(slot);
+        cache_lru_push_back(slot);
+    }
+}
 
-            if (found_next_segment)
-            {
-                break;
-            }
+// Drop every cached block of a segment without writing it back, used before the segment is closed. A slot of a mapped segment points into the mapping and must not outlive it.
+static void cache_discard_segment(int kind, uint32_t segment_num)
+{
+    for (int slot = 0; slot < BLOCK_CACHE_BLOCKS && cache_initialized; slot++)
+    {
+        int block_number = block_cache[slot].block_number;
+        if (block_number >= 0 && block_cache[slot].kind == kind && block_number / geometry.blocks_per_segment == segment_num)
+        {
+            cache_discard(kind, block_number);
         }
+    }
+}
 
-        if (!found_next_segment)
+// Write back every dirty cached block
+static void flush_block_cache()
+{
+    for (int slot = 0; slot < BLOCK_CACHE_BLOCKS && cache_initialized; slot++)
+    {
+        if (block_cache[slot].block_number >= 0 && block_cache[slot].dirty)
         {
-            if (verbose)
-            {
-
-                fprintf(stderr, "Path component %s not found\n", path_segments[i]);
-            }
-            return -1;
+            cache_write_back(slot);
         }
     }
+}
 
-    inode_t file_inode;
-
-    if (read_inode(current_inode_index, &file_inode) < 0)
+// Punch a hole over the slots of a run of freed blocks that are still free
+static void punch_run(int kind, uint32_t first, uint32_t length)
+{
+    segment_handle_t *segment = get_segment(kind, first / geometry.blocks_per_segment, 0);
+    if (segment == NULL || segment->bitmap == NULL)
     {
-        fprintf(stderr, "Failed to read file inode at index %d\n", current_inode_index);
-        return -1;
+        return;
     }
 
-    if (file_inode.double_indirect != MAX_UNIT_32)
+    uint32_t index = first % geometry.blocks_per_segment;
+    uint32_t end = index + length;
+    while (index < end)
     {
-        // Print the directory_entries of the double indirect block
-        directoryblock_t indirect_block;
-        if (read_directory_block(file_inode.double_indirect, &indirect_block) < 0)
+        index = bitmap_next(segment->bitmap, index, 0);
+        if (index >= end)
         {
-            fprintf(stderr, "Failed to read indirect block\n");
-            return -1;
+            break;
         }
-
-        // Print the entries in the indirect block
-        for (int m = 0; m < MAX_DIRECTORY_ENTRIES; m++)
+        uint32_t used = bitmap_next(segment->bitmap, index, 1);
+        uint32_t run_end = used < end ? used : end;
+        if (fallocate(segment->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, segment_offset(segment, index), (off_t)(run_end - index) * geometry.block_size) == 0)
         {
-            if (indirect_block.entries[m].inuse == 1)
-            {
-                directoryblock_t another_indirect_block;
-                if (read_directory_block(indirect_block.entries[m].inode_number, &another_indirect_block) < 0)
-                {
-                    fprintf(stderr, "Failed to read indirect block\n");
-                    return -1;
-                }
-
-                for (int n = 0; n < MAX_DIRECTORY_ENTRIES; n++)
-                {
-                    if (another_indirect_block.entries[n].inuse == 1)
-                    {
-                        datablock_t datablock;
-                        int result = read_datablock(another_indirect_block.entries[n].inode_number, &datablock);
-                        if (result < 0)
-                        {
-                            fprintf(stderr, "Failed to read indirect datablock\n");
-                            return -1;
-                        }
-
-                        int last_block_size = file_inode.size % BLOCK_SIZE;
-                        int last_block_index = file_inode.size / BLOCK_SIZE;
-                        int loop_till = BLOCK_SIZE;
-
-                        if (last_block_index == ((128 * m) + n))
-                        {
-                            loop_till = last_block_size;
-                        }
-
-                        // Only print if verbose flag is set
-                        if (verbose)
-                        {
-                            // Print everything as removing null characters break binary files
-                            for (int p = 0; p < loop_till; p++)
-                            {
-                                printf("%c", datablock.data[p]);
-                            }
-                        }
-                    }
-                }
-            }
+            STAT_INC(hole_punches);
         }
+        index = run_end;
     }
-    // If the inode doesn't have a single indirect block
-    else if (file_inode.single_indirect != MAX_UNIT_32)
+}
+
+static int compare_block_numbers(const void *a, const void *b)
+{
+    uint32_t x = *(const uint32_t *)a;
+    uint32_t y = *(const uint32_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+// Function punch_freed_blocks that releases the host disk space of the block slots freed during the operation. The slots are sorted and merged into runs of consecutive slots in one segment, so removing a large file costs one fallocate call per run instead of one per block. Slots allocated again since they were freed are left alone.
+static void punch_freed_blocks(int kind)
+{
+    block_list_t *list = &freed_blocks[kind];
+    qsort(list->blocks, list->count, sizeof(uint32_t), compare_block_numbers);
+
+    int i = 0;
+    while (i < list->count)
     {
-        // Print the directory_entries of the single indirect block
-        directoryblock_t indirect_block;
-        if (read_directory_block(file_inode.single_indirect, &indirect_block) < 0)
+        uint32_t first = list->blocks[i];
+        uint32_t last = first;
+        for (i++; i < list->count && (list->blocks[i] == last || (list->blocks[i] == last + 1 && list->blocks[i] / geometry.blocks_per_segment == first / geometry.blocks_per_segment)); i++)
         {
-            fprintf(stderr, "Failed to read indirect block\n");
-            return -1;
+            last = list->blocks[i];
         }
+        punch_run(kind, first, last - first + 1);
+    }
+    list->count = 0;
+}
 
-        // Print the entries in the indirect block
-        for (int m = 0; m < MAX_DIRECTORY_ENTRIES; m++)
-        {
-            if (indirect_block.entries[m].inuse == 1)
-            {
-                datablock_t datablock;
-                int result = read_datablock(indirect_block.entries[m].inode_number, &datablock);
-                if (result < 0)
-                {
-                    fprintf(stderr, "Failed to read indirect datablock\n");
-                    return -1;
-                }
-
-                int last_block_size = file_inode.size % BLOCK_SIZE;
-                int last_block_index = file_inode.size / BLOCK_SIZE;
-                int loop_till = BLOCK_SIZE;
+// Unmap and close an open segment handle
+static void close_segment(segment_handle_t *segment)
+{
+    if (segment->map != NULL)
+    {
+        munmap(segment->map, geometry.segment_size);
+    }
+    else
+    {
+        free(segment->bitmap);
+    }
+    if (segment->fd >= 0 && segment->fd != image_fd)
+    {
+        close(segment->fd);
+    }
+    memset(segment, 0, sizeof(segment_handle_t));
+    segment->fd = -1;
+}
 
-                if (last_block_index == m)
-                {
-                    loop_till = last_block_size;
-                }
+// Function trim_free_segments that removes the segments of a kind at the end of the volume that no longer hold any block. Segment files are deleted and an image is truncated after the last segment of either kind still in use. The first segment of each kind, holding the root, is always kept.
+static void trim_free_segments(int kind)
+{
+    uint32_t count = superblock.segment_count[kind];
+    while (count > 1 && summary_get(kind, count - 1) == geometry.blocks_per_segment)
+    {
+        segment_handle_t *segment = get_segment(kind, count - 1, 0);
+        if (segment == NULL || segment->bitmap == NULL || bitmap_count_free(segment->bitmap) != geometry.blocks_per_segment)
+        {
+            break;
+        }
 
-                // Only print if verbose flag is set
-                if (verbose)
-                {
-                    // Print everything as removing null characters break binary files
-                    for (int n = 0; n < loop_till; n++)
-                    {
-                        printf("%c", datablock.data[n]);
-                    }
-                }
+        cache_discard_segment(kind, count - 1);
+        close_segment(segment);
+        if (image_fd < 0)
+        {
+            char filename[32];
+            sprintf(filename, kind == SEGMENT_KIND_INODE ? INODE_SEGMENT_NAME_PATTERN : DATA_SEGMENT_NAME_PATTERN, count - 1);
+            if (unlink(filename) != 0)
+            {
+                break;
             }
         }
+        summary_set(kind, count - 1, SUMMARY_UNKNOWN);
+        STAT_INC(segments_trimmed);
+        count--;
     }
-    // If the inode block has direct blocks
-    else
+
+    if (count == superblock.segment_count[kind])
+    {
+        return;
+    }
+    superblock.segment_count[kind] = count;
+    if (superblock.first_free[kind] > count)
+    {
+        superblock.first_free[kind] = count;
+    }
+    summary.dirty = 1;
+
+    if (image_fd >= 0)
     {
-        for (int m = 0; m < MAX_DIRECT_BLOCKS; m++)
+        off_t end = 0;
+        for (int other = 0; other < 2; other++)
         {
-            if (file_inode.direct_blocks[m] == MAX_UNIT_32)
+            if (superblock.segment_count[other] > 0 && image_segment_base(other, superblock.segment_count[other] - 1) + geometry.segment_size > end)
             {
-                break; // No more direct blocks
+                end = image_segment_base(other, superblock.segment_count[other] - 1) + geometry.segment_size;
             }
+        }
+        struct stat st;
+        if (end > 0 && fstat(image_fd, &st) == 0 && st.st_size > end)
+        {
+            ftruncate(image_fd, end);
+        }
+    }
+}
+
+// Write back all pending changes at the end of an operation: dirty cached blocks, modified bitmap copies, and the dirty pages of every mapped segment (with msync)
+void sync_segments()
+{
+    long page_size = sysconf(_SC_PAGESIZE);
 
-            datablock_t datablock;
+    flush_block_cache();
 
-            int result = read_datablock(file_inode.direct_blocks[m], &datablock);
-            if (result < 0)
+    for (int kind = 0; kind < 2; kind++)
+    {
+        segment_table_t *table = &segment_tables[kind];
+        for (int i = 0; i < table->capacity; i++)
+        {
+            segment_handle_t *segment = &table->segments[i];
+            if (segment->bitmap_changed && segment->bitmap != NULL)
             {
-                fprintf(stderr, "Failed to read datablock\n");
-                return -1;
+                summary_set_run(kind, i, bitmap_largest_run(segment->bitmap));
+                segment->bitmap_changed = 0;
             }
-
-            int last_block_size = file_inode.size % BLOCK_SIZE;
-            int last_block_index = file_inode.size / BLOCK_SIZE;
-            int loop_till = BLOCK_SIZE;
-
-            if (last_block_index == m)
+            if (segment->bitmap_dirty)
             {
-                loop_till = last_block_size;
+                segment_pwrite(segment->fd, segment->bitmap, geometry.bitmap_bytes, segment->base);
+                segment->bitmap_dirty = 0;
             }
 
-            // Only print if verbose flag is set
-            if (verbose)
+            if (segment->map == NULL || segment->dirty_start >= segment->dirty_end)
             {
-                // Print everything as removing null characters break binary files
-                for (int n = 0; n < loop_till; n++)
-                {
-                    printf("%c", datablock.data[n]);
-                }
+                continue;
             }
+
+            size_t start = segment->dirty_start - (segment->dirty_start % page_size);
+            msync(segment->map + start, segment->dirty_end - start, MS_SYNC);
+            STAT_INC(msyncs);
+            segment->dirty_start = geometry.segment_size;
+            segment->dirty_end = 0;
         }
     }
 
-    return 0;
+#if USE_PUNCH_HOLE
+    // Release what the operation freed once everything else is on disk
+    for (int kind = 0; kind < 2; kind++)
+    {
+        if (freed_blocks[kind].count > 0)
+        {
+            punch_freed_blocks(kind);
+            trim_free_segments(kind);
+        }
+    }
+#endif
+
+    // The summary goes last so it never claims space the bitmaps don't have on disk yet
+    sync_summary();
 }
 
-// Function to add file to the filesystem
-int add_file(const char *fs_path, const char *local_file)
+// Close every segment file opened through get_segment, writing back pending changes first
+void close_segment_files()
 {
+    sync_segments();
 
-    if (extract_file(fs_path, 0) == 0)
+    for (int kind = 0; kind < 2; kind++)
     {
-        fprintf(stderr, "Failed ! Filename already exists.\n");
-        // printf("Failed ! Filename already exists.\n");
-        return -1;
+        segment_table_t *table = &segment_tables[kind];
+        for (int i = 0; i < table->capacity; i++)
+        {
+            close_segment(&table->segments[i]);
+        }
+        free(table->segments);
+        free(freed_blocks[kind].blocks);
+        memset(&freed_blocks[kind], 0, sizeof(block_list_t));
+        table->segments = NULL;
+        table->capacity = 0;
     }
 
-    // In the add_file function:
-    char *path_segments[256];
-    int segment_count = split_path(fs_path, path_segments, 256);
-
-    // // Print the segments
-    // printf("Path Segments:\n");
-    // for (int i = 0; i < segment_count; i++)
-    // {
-    //     printf("%s\n", path_segments[i]);
-    // }
+    if (superblock_fd >= 0)
+    {
+        close(superblock_fd);
+        superblock_fd = -1;
+        image_fd = -1;
+    }
+    free(summary.entry);
+    summary.entry = NULL;
+    summary.entries = 0;
+    for (int kind = 0; kind < 2; kind++)
+    {
+        free(free_index[kind].tree);
+        free_index[kind].tree = NULL;
+        free_index[kind].leaves = 0;
+    }
+}
 
-    // printf("Size of file %d", sizeof(local_file));
+// Function read_block_at that reads size bytes from offset offset of block block_number of the given segment kind. The divisor by blocks_per_segment is the segment number and the remainder is the block index inside the segment. If the segment file is not found return -1. If the block is not in use return -2. If the block is found return 0.
+static int read_block_at(int kind, int block_number, size_t offset, void *block, size_t size)
+{
+    int segment_num = block_number / geometry.blocks_per_segment; // Calculate segment number
+    int block_index = block_number % geometry.blocks_per_segment; // Calculate block index
 
-    size_t inode_index = create_inode_for_file(local_file);
-    if (inode_index < 0)
+    segment_handle_t *segment = get_segment(kind, segment_num, 0);
+    if (segment == NULL)
     {
-        fprintf(stderr, "Failed to create inode for file\n");
-        return -1;
+        return -1; // File not found
     }
 
-    directoryblock_t directoryblock;
-
-    for (int i = 0; i < MAX_DIRECTORY_ENTRIES; i++)
+    // Check if the block is used
+    if (segment->bitmap == NULL || !bitmap_test(segment->bitmap, block_index))
     {
-        directoryblock.entries[i].inode_number = MAX_UNIT_32;
-        directoryblock.entries[i].type = MAX_UNIT_32;
-        directoryblock.entries[i].inuse = 0;
-        strncpy(directoryblock.entries[i].name, "", sizeof(directoryblock.entries[i].name) - 1);
-        directoryblock.entries[i].name[sizeof(directoryblock.entries[i].name) - 1] = '\0'; // Ensure null termination
+        return -2; // Block not found
     }
 
-    int root_directoryblock_index = create_directoryblock(&directoryblock);
+    int slot = cache_get(kind, block_number, segment, 1);
+    if (slot < 0)
+    {
+        return -2; // Failed to read block
+    }
 
-    // Adding the current file to the root directory
-    directory_entry_t new_entry;
-    new_entry.inode_number = inode_index; // Placeholder for inode number
-    new_entry.type = FILE_TYPE_REGULAR;
-    strncpy(new_entry.name, path_segments[segment_count - 1], sizeof(new_entry.name) - 1);
-    new_entry.name[sizeof(new_entry.name) - 1] = '\0';                           // Ensure null termination
-                                                                                 // Directory type
-    new_entry.inuse = 1;                                                         // Mark as in-use
-    add_directoryentry_to_directoryblock(root_directoryblock_index, &new_entry); // Adding the file to the root directory
+    memcpy(block, block_cache[slot].data + offset, size);
+    return 0; // Success
+}
 
-    // Create directory for each segment if the directory is already not present and link them together with inodes in between them.
-    //     If the fs_path is /dir1/dir2/sample.txt
-    // Then the root inode at inode_index 0 will have direct_blocks mapping to directory_block at index 0.
-    // Now inode for dir1 is created and then a new directory entry for under the root_directory block is created storing name as dir1 and the inode_number for recently created inode of dir1.
-    // Similarly, do the same for dir2 and save its inode_number in dir1 directory block that is accessed in inode direct_blocks[0].
-    // Now create a inode of type file and point it to the file created and then save the inode number and file name in the directory block of dir2.
-    // So now the chain would look something like this root inode -> root directory block -> dir1 inode -> dir1 directory block -> dir2 inode -> dir2 directory block -> sample.txt inode -> sample.txt directory block.
-    // For accessing each directory block, the inode of each has direct_blocks array where the first element of that direct_blocks array has index in the directory/datablock segment.
+// Function read_block that reads the first size bytes of block block_number of the given segment kind, see read_block_at
+static int read_block(int kind, int block_number, void *block, size_t size)
+{
+    return read_block_at(kind, block_number, 0, block, size);
+}
 
-    // Start with root inode (assumed to be at index 0)
-    int current_inode_index = 0;
-    inode_t current_inode;
-    directoryblock_t current_dir_block;
+// Function write_block_at that overwrites size bytes at offset offset of an already allocated block in place. The write goes to the buffer cache and reaches the segment on write-back. Returns 0 on success and -1 on failure.
+static int write_block_at(int kind, int block_number, size_t offset, const void *block, size_t size)
+{
+    segment_handle_t *segment = get_segment(kind, block_number / geometry.blocks_per_segment, 0);
+    if (segment == NULL)
+    {
+        return -1;
+    }
 
-    // For each directory segment (except the last one which is the file)
-    for (int i = 0; i < segment_count - 1; i++)
+    // Partial writes need the rest of the block loaded first
+    int slot = cache_get(kind, block_number, segment, size < geometry.block_size);
+    if (slot < 0)
     {
-        // Read the current inode
-        if (read_inode(current_inode_index, &current_inode) < 0)
-        {
-            fprintf(stderr, "Failed to read inode at index %d\n", current_inode_index);
-            return -1;
-        }
+        return -1;
+    }
 
-        // Find the directory block for this inode
-        int dir_block_index = -1;
-        for (int j = 0; j < MAX_DIRECT_BLOCKS; j++)
-        {
-            if (current_inode.direct_blocks[j] != MAX_UNIT_32 &&
-                current_inode.direct_blocks[j] != 0)
-            {
-                dir_block_index = current_inode.direct_blocks[j];
-                break;
-            }
-        }
+    memcpy(block_cache[slot].data + offset, block, size);
+    block_cache[slot].dirty = 1;
+    return 0;
+}
 
-        if (dir_block_index < 0)
+// Function write_block that overwrites the first size bytes of an already allocated block in place, see write_block_at
+static int write_block(int kind, int block_number, const void *block, size_t size)
+{
+    return write_block_at(kind, block_number, 0, block, size);
+}
+
+// Function load_summary that loads the allocation summary of the volume and builds the free-run index from it. Volumes that don't have a summary yet get it built by measuring the bitmap of every segment, once. A summary of free counts only, from before SUPERBLOCK_RUN_SUMMARY, is converted with the largest runs unknown. Returns 0 on success and -1 on failure.
+static int load_summary()
+{
+    if (superblock.flags & SUPERBLOCK_ALLOC_SUMMARY)
+    {
+        uint32_t segments = superblock.segment_count[0] > superblock.segment_count[1] ? superblock.segment_count[0] : superblock.segment_count[1];
+        if (segments > 0)
         {
-            // This inode doesn't point to any directory block yet, create one
-            for (int k = 0; k < MAX_DIRECTORY_ENTRIES; k++)
-            {
-                directoryblock.entries[k].inuse = 0;
-            }
-            dir_block_index = create_directoryblock(&directoryblock);
-            if (dir_block_index < 0)
+            // Grow the table to cover every segment, then fill it from disk
+            summary_set(SEGMENT_KIND_DATA, segments - 1, SUMMARY_UNKNOWN);
+            uint64_t entries = (uint64_t)segments * 2 < summary.entries ? (uint64_t)segments * 2 : summary.entries;
+            if (superblock.flags & SUPERBLOCK_RUN_SUMMARY)
             {
-                fprintf(stderr, "Failed to create directory block\n");
-                return -1;
+                segment_pread(superblock_fd, summary.entry, entries * sizeof(summary_entry_t), SUMMARY_OFFSET);
             }
-
-            // Update the inode to point to this directory block
-            for (int j = 0; j < MAX_DIRECT_BLOCKS; j++)
+            else
             {
-                if (current_inode.direct_blocks[j] == 0 ||
-                    current_inode.direct_blocks[j] == MAX_UNIT_32)
+                uint32_t *counts = calloc(entries, sizeof(uint32_t));
+                if (counts == NULL)
                 {
-                    current_inode.direct_blocks[j] = dir_block_index;
-
-                    // Write the updated inode
-                    FILE *inode_file = NULL;
-                    char inode_filename[32];
-                    int segment_num = current_inode_index / 255;
-                    int inode_idx = current_inode_index % 255;
-
-                    sprintf(inode_filename, INODE_SEGMENT_NAME_PATTERN, segment_num);
-                    inode_file = fopen(inode_filename, "r+b");
-                    if (inode_file == NULL)
-                    {
-                        return -1;
-                    }
-
-                    fseek(inode_file, (inode_idx + 1) * INODE_SIZE, SEEK_SET);
-                    fwrite(&current_inode, sizeof(inode_t), 1, inode_file);
-                    fclose(inode_file);
-                    break;
+                    return -1;
                 }
+                segment_pread(superblock_fd, counts, entries * sizeof(uint32_t), SUMMARY_OFFSET);
+                for (uint64_t i = 0; i < entries; i++)
+                {
+                    summary.entry[i].free_count = counts[i];
+                }
+                free(counts);
             }
         }
 
-        // Read the directory block
-        if (read_directory_block(dir_block_index, &current_dir_block) < 0)
+        summary.dirty = !(superblock.flags & SUPERBLOCK_RUN_SUMMARY);
+        superblock.flags |= SUPERBLOCK_RUN_SUMMARY;
+        for (int kind = 0; kind < 2; kind++)
         {
-            fprintf(stderr, "Failed to read directory block at index %d\n", dir_block_index);
-            return -1;
+            if (free_index_build(kind, superblock.segment_count[kind]) < 0)
+            {
+                return -1;
+            }
         }
+        return 0;
+    }
 
-        // Look for the directory entry for the next path segment
-        directory_entry_t *found_entry = NULL;
-        int entry_index = find_entry_in_directory(&current_dir_block, path_segments[i], &found_entry);
+    for (int kind = 0; kind < 2; kind++)
+    {
+        uint32_t segment_num = 0;
+        segment_handle_t *segment;
 
-        if (entry_index < 0)
+        superblock.first_free[kind] = UINT32_MAX;
+        while ((segment = get_segment(kind, segment_num, 0)) != NULL)
         {
-            // Directory doesn't exist, create it
-            inode_t new_dir_inode;
-            memset(&new_dir_inode, 0, sizeof(inode_t));
-            new_dir_inode.type = FILE_TYPE_DIRECTORY;
-            new_dir_inode.single_indirect = MAX_UNIT_32;
-            new_dir_inode.double_indirect = MAX_UNIT_32;
-            for (int j = 0; j < MAX_DIRECT_BLOCKS; j++)
-            {
-                new_dir_inode.direct_blocks[j] = MAX_UNIT_32;
-            }
-
-            // Create the new inode for the directory
-            int new_inode_index = create_inode(&new_dir_inode);
-            if (new_inode_index < 0)
+            uint32_t free_count = segment->bitmap != NULL ? bitmap_count_free(segment->bitmap) : SUMMARY_UNKNOWN;
+            summary_set(kind, segment_num, free_count);
+            if (segment->bitmap != NULL)
             {
-                fprintf(stderr, "Failed to create inode for directory %s\n", path_segments[i]);
-                return -1;
+                summary_set_run(kind, segment_num, bitmap_largest_run(segment->bitmap));
             }
-
-            // Add directory entry to the current directory block
-            directory_entry_t new_entry;
-            new_entry.inode_number = new_inode_index;
-            new_entry.type = FILE_TYPE_DIRECTORY;
-            new_entry.inuse = 1;
-            strncpy(new_entry.name, path_segments[i], sizeof(new_entry.name) - 1);
-            new_entry.name[sizeof(new_entry.name) - 1] = '\0';
-
-            if (add_directoryentry_to_directoryblock(dir_block_index, &new_entry) < 0)
+            if (free_count != 0 && superblock.first_free[kind] == UINT32_MAX)
             {
-                fprintf(stderr, "Failed to add directory entry for %s\n", path_segments[i]);
-                return -1;
+                superblock.first_free[kind] = segment_num;
             }
+            segment_num++;
+        }
 
-            current_inode_index = new_inode_index;
+        superblock.segment_count[kind] = segment_num;
+        if (superblock.first_free[kind] == UINT32_MAX)
+        {
+            superblock.first_free[kind] = segment_num;
         }
-        else
+    }
+
+    superblock.flags |= SUPERBLOCK_ALLOC_SUMMARY | SUPERBLOCK_RUN_SUMMARY;
+    summary.dirty = 1;
+    for (int kind = 0; kind < 2; kind++)
+    {
+        if (free_index_build(kind, superblock.segment_count[kind]) < 0)
         {
-            // Directory exists, continue with its inode
-            current_inode_index = found_entry->inode_number;
+            return -1;
         }
     }
+    return 0;
+}
 
-    // Now add the file to the last directory
-    if (read_inode(current_inode_index, &current_inode) < 0)
+// Put a freshly allocated block in the cache, it is written to the segment on write-back. Returns 0 on success and -1 on failure.
+static int store_new_block(int kind, int block_number, segment_handle_t *segment, const void *block, size_t size)
+{
+    int slot = cache_get(kind, block_number, segment, 0);
+    if (slot < 0)
     {
-        fprintf(stderr, "Failed to read final directory inode\n");
+        perror("Failed to write block to file");
         return -1;
     }
+    memcpy(block_cache[slot].data, block, size);
+    memset(block_cache[slot].data + size, 0, geometry.block_size - size);
+    block_cache[slot].dirty = 1;
+    return 0;
+}
 
-    // Find the directory block for this inode
-    int dir_block_index = -1;
-    for (int j = 0; j < MAX_DIRECT_BLOCKS; j++)
+// Allocation goals. Blocks are placed near a goal segment so that a directory, the inodes of its entries and their data share few segments, in the spirit of the Orlov allocator: every new top level directory starts a group of its own with spread_goal() and everything below it is placed near its parent directory.
+#define ALLOC_GOAL_NONE UINT32_MAX // No preference, next fit from the segment of superblock.next_fit
+#define ALLOC_GOAL_FIRST 0         // First fit from first_free
+
+// Function alloc_search_segment that returns the segment an allocation for goal visits at step of its search, count being the number of segments when the search started. A goal inside the volume is searched from the goal to the last segment, then from first_free up to the goal, then new segments are added. A goal past the last segment starts a new segment straight away. ALLOC_GOAL_NONE, or a goal before first_free, is first fit from first_free.
+static uint32_t alloc_search_segment(int kind, uint32_t goal, uint32_t count, uint32_t step)
+{
+    uint32_t first = superblock.first_free[kind];
+    if (goal == ALLOC_GOAL_NONE || goal <= first)
     {
-        if (current_inode.direct_blocks[j] != MAX_UNIT_32 &&
-            current_inode.direct_blocks[j] != 0)
-        {
-            dir_block_index = current_inode.direct_blocks[j];
-            break;
-        }
+        return first + step;
     }
+    if (goal >= count)
+    {
+        return count + step;
+    }
+    if (goal + step < count)
+    {
+        return goal + step;
+    }
+    step -= count - goal;
+    return first + step < goal ? first + step : count + step - (goal - first);
+}
 
-    if (dir_block_index < 0)
+// Function alloc_search_next that returns the next segment, from search position *step on, in the order alloc_search_segment gives, that the free-run index allows a run of length slots in. Segments that can't have one are skipped in O(log n) without being visited; positions past the existing segments always qualify. *step is advanced past the returned segment.
+static uint32_t alloc_search_next(int kind, uint32_t goal, uint32_t count, uint32_t length, uint32_t *step)
+{
+    while (1)
+    {
+        uint32_t segment_num = alloc_search_segment(kind, goal, count, *step);
+        if (segment_num >= count)
+        {
+            (*step)++;
+            return segment_num;
+        }
+
+        // The stretch of existing segments searched in order: from the goal to the last segment, or from first_free up to the goal
+        uint32_t first = superblock.first_free[kind];
+        uint32_t end = goal != ALLOC_GOAL_NONE && goal > first && goal < count && segment_num < goal ? goal : count;
+        uint32_t found = free_index_find(kind, segment_num, end, length);
+        if (found == FREE_INDEX_NONE)
+        {
+            *step += end - segment_num;
+            continue;
+        }
+        *step += found - segment_num + 1;
+        return found;
+    }
+}
+
+// Function spread_goal that picks the segment a new top level directory starts its group in: the first existing segment of the kind, from the segment of the next-fit cursor on and wrapping around to first_free, whose free count is at least the average, so separate subtrees are spread over the emptier part of the volume. A new segment after the last one is only used when no existing segment has a free slot.
+static uint32_t spread_goal(int kind)
+{
+    uint32_t count = superblock.segment_count[kind];
+    uint64_t total = 0;
+    uint32_t counted = 0;
+    for (uint32_t segment_num = superblock.first_free[kind]; segment_num < count; segment_num++)
+    {
+        uint32_t free_count = summary_get(kind, segment_num);
+        if (free_count != SUMMARY_UNKNOWN)
+        {
+            total += free_count;
+            counted++;
+        }
+    }
+    if (total == 0)
+    {
+        return count;
+    }
+
+    // Segments before first_free are full and count towards the average as such
+    uint64_t average = total / (counted + superblock.first_free[kind]);
+    uint32_t first = superblock.first_free[kind];
+    uint32_t start = superblock.next_fit[kind] / geometry.blocks_per_segment;
+    if (start < first || start >= count)
+    {
+        start = first;
+    }
+    for (uint32_t i = 0; i < count - first; i++)
+    {
+        uint32_t segment_num = start + i < count ? start + i : start + i - (count - first);
+        uint32_t free_count = summary_get(kind, segment_num);
+        if (free_count != SUMMARY_UNKNOWN && free_count > 0 && free_count >= average)
+        {
+            return segment_num;
+        }
+    }
+    return count;
+}
+
+// Move the first_free hint past segments the summary knows are full
+static void advance_first_free(int kind)
+{
+    uint32_t segment_num = superblock.first_free[kind];
+    while (segment_num < superblock.segment_count[kind] && summary_get(kind, segment_num) == 0)
+    {
+        segment_num++;
+    }
+    if (superblock.first_free[kind] != segment_num)
+    {
+        superblock.first_free[kind] = segment_num;
+        summary.dirty = 1;
+    }
+}
+
+// Function create_block that saves a block to a free slot of the given kind, searching the segments in the order alloc_search_segment gives for goal and creating a new segment when no existing one has room. Allocations without a goal are next fit: they continue from the persistent cursor superblock.next_fit, wrapping around to first_free once the segments after it are full, so a run of allocations does not search the full segments before the cursor again and again. Inside a segment the search starts at the cursor slot when the cursor is in that segment, and wraps around to the start of the segment. Returns the overall block number or -1 on failure.
+static int create_block(int kind, uint32_t goal, const void *block, size_t size)
+{
+    uint32_t count = superblock.segment_count[kind];
+    uint32_t cursor = superblock.next_fit[kind];
+    if (goal == ALLOC_GOAL_NONE && cursor / geometry.blocks_per_segment < count)
+    {
+        goal = cursor / geometry.blocks_per_segment;
+    }
+
+    // Try segments until we find one with free space, the free-run index skips the ones known to be full without opening them
+    uint32_t step = 0;
+    while (1)
+    {
+        uint32_t segment_num = alloc_search_next(kind, goal, count, 1, &step);
+        uint32_t free_count = summary_get(kind, segment_num);
+
+        segment_handle_t *segment = get_segment(kind, segment_num, 1);
+        if (segment == NULL)
+        {
+            perror(kind == SEGMENT_KIND_INODE ? "Failed to create inode segment file" : "Failed to create data segment file");
+            return -1;
+        }
+        STAT_INC(alloc_segment_visits);
+
+        if (segment_num >= superblock.segment_count[kind])
+        {
+            superblock.segment_count[kind] = segment_num + 1;
+            summary.dirty = 1;
+        }
+
+        uint8_t *bitmap = segment->bitmap;
+        if (bitmap == NULL)
+        {
+            continue;
+        }
+
+        // Find an empty block in the bitmap, from the cursor slot on if the cursor is in this segment
+        int i = -1;
+        if (cursor / geometry.blocks_per_segment == segment_num)
+        {
+            uint32_t next = bitmap_next(bitmap, cursor % geometry.blocks_per_segment, 0);
+            i = next < geometry.blocks_per_segment ? (int)next : -1;
+        }
+        if (i < 0)
+        {
+            i = bitmap_find_free(bitmap);
+        }
+        if (i < 0)
+        {
+            summary_set(kind, segment_num, 0);
+        }
+        else
+        {
+            if (free_count == SUMMARY_UNKNOWN || free_count == 0)
+            {
+                free_count = bitmap_count_free(bitmap);
+            }
+
+            // Mark the block as used and update the bitmap, the summary and the cursor
+            bitmap_set(bitmap, i, 1);
+            mark_bitmap_dirty(segment);
+            summary_set(kind, segment_num, free_count - 1);
+            advance_first_free(kind);
+
+            int block_number = (segment_num * geometry.blocks_per_segment) + i;
+            superblock.next_fit[kind] = block_number + 1;
+            summary.dirty = 1;
+            if (store_new_block(kind, block_number, segment, block, size) < 0)
+            {
+                return -1;
+            }
+            return block_number; // Return overall index for success
+        }
+    }
+}
+
+// Function allocate_extent that reserves a run of contiguous free block slots for file data in one call. The run is want blocks long, capped at one segment, and is taken from the first segment in the search order for goal that has a free run that long; segments the free-run index rules out are skipped without being opened, and a segment found too fragmented has its largest run recorded. When no existing segment has a run that long the run is shortened to the longest one the free-run index still holds, so holes are filled before the volume grows, and a new segment is only used once the existing segments are full. The slots are marked used but nothing is written to them. Returns the length of the run and stores its first block number in start, or -1 on failure.
+static int allocate_extent(int kind, uint32_t want, uint32_t goal, uint32_t *start)
+{
+    uint32_t length = want < geometry.blocks_per_segment ? want : geometry.blocks_per_segment;
+    if (length == 0)
+    {
+        return -1;
+    }
+
+    uint32_t count = superblock.segment_count[kind];
+    uint32_t step = 0;
+    while (1)
+    {
+        uint32_t segment_num = alloc_search_next(kind, goal, count, length, &step);
+        if (segment_num >= count)
+        {
+            // No existing segment has a run this long, settle for the longest run left. A goal past the last segment did not look at the existing ones, so they are searched once from first_free.
+            uint32_t largest = free_index_max(kind, superblock.first_free[kind], count);
+            int skipped = goal != ALLOC_GOAL_NONE && goal >= count;
+            if (largest > 0 && (largest < length || skipped))
+            {
+                length = largest < length ? largest : length;
+                goal = skipped ? ALLOC_GOAL_FIRST : goal;
+                step = 0;
+                continue;
+            }
+        }
+        uint32_t free_count = summary_get(kind, segment_num);
+
+        segment_handle_t *segment = get_segment(kind, segment_num, 1);
+        if (segment == NULL)
+        {
+            perror("Failed to create data segment file");
+            return -1;
+        }
+        STAT_INC(alloc_segment_visits);
+
+        // A segment past the recorded count is new and its summary entry is not meaningful yet
+        if (segment_num >= superblock.segment_count[kind])
+        {
+            superblock.segment_count[kind] = segment_num + 1;
+            summary.dirty = 1;
+            free_count = SUMMARY_UNKNOWN;
+        }
+        if (segment->bitmap == NULL)
+        {
+            continue;
+        }
+
+        if (free_count == SUMMARY_UNKNOWN)
+        {
+            free_count = bitmap_count_free(segment->bitmap);
+            summary_set(kind, segment_num, free_count);
+        }
+        int first = free_count >= length ? bitmap_find_run(segment->bitmap, length) : -1;
+        if (first < 0)
+        {
+            // Too fragmented, record its largest run so later searches pass it by
+            summary_set_run(kind, segment_num, bitmap_largest_run(segment->bitmap));
+            continue;
+        }
+
+        bitmap_set_range(segment->bitmap, first, length, 1);
+        mark_bitmap_dirty(segment);
+        summary_set(kind, segment_num, free_count - length);
+        advance_first_free(kind);
+
+        *start = segment_num * geometry.blocks_per_segment + first;
+        return length;
+    }
+}
+
+// Function free_block that marks a block as free in the bitmap of its segment. Returns 0 on success and -1 on failure.
+static int free_block(int kind, int block_number)
+{
+    segment_handle_t *segment = get_segment(kind, block_number / geometry.blocks_per_segment, 0);
+    if (segment == NULL || segment->bitmap == NULL)
+    {
+        return -1;
+    }
+
+    uint32_t segment_num = block_number / geometry.blocks_per_segment;
+    uint32_t free_count = summary_get(kind, segment_num);
+    if (bitmap_test(segment->bitmap, block_number % geometry.blocks_per_segment) && free_count != SUMMARY_UNKNOWN)
+    {
+        summary_set(kind, segment_num, free_count + 1);
+    }
+    summary_note_free(kind, segment_num);
+
+    bitmap_set(segment->bitmap, block_number % geometry.blocks_per_segment, 0); // Mark as free
+    mark_bitmap_dirty(segment);
+    cache_discard(kind, block_number);
+#if USE_PUNCH_HOLE
+    block_list_append(&freed_blocks[kind], block_number);
+#endif
+
+    return 0;
+}
+
+// Function release_blocks that hands back block slots claimed with allocate_blocks, for example the unused part of a reservation or the blocks of a file whose ingest failed. Blocks already written are dropped from the cache.
+static void release_blocks(int kind, const uint32_t *blocks, uint32_t count)
+{
+    for (uint32_t i = 0; i < count; i++)
+    {
+        free_block(kind, blocks[i]);
+    }
+}
+
+// Function allocate_blocks that claims count free block slots of the given kind near segment goal in one call and stores their block numbers in out, in ascending runs. The slots are taken a contiguous run at a time with allocate_extent, so every segment touched gets a single bitmap update however many blocks it provides. Nothing is written to the slots; callers fill them with write_reserved_block and return the ones they do not use with release_blocks. Returns 0 on success and -1 on failure, in which case nothing stays claimed.
+static int allocate_blocks(int kind, uint32_t count, uint32_t goal, uint32_t *out)
+{
+    uint32_t claimed = 0;
+    while (claimed < count)
+    {
+        uint32_t start;
+        int length = allocate_extent(kind, count - claimed, goal, &start);
+        if (length < 0)
+        {
+            release_blocks(kind, out, claimed);
+            return -1;
+        }
+        for (int i = 0; i < length; i++)
+        {
+            out[claimed++] = start + i;
+        }
+    }
+    return 0;
+}
+
+// function read_directory_block that takes a directory block number and read the directory block from the segment file. If the directory block number is greater than 255 take divisor as a file name number and take the remainder as the directory block number. Read the segment file and read the directory block from the file. If the file is not found return -1. If the directory block is not found return -2. If the directory block is found return 0.
+int read_directory_block(int directory_block_number, directoryblock_t *directory_block)
+{
+    return read_block(SEGMENT_KIND_DATA, directory_block_number, directory_block, sizeof(directoryblock_t));
+}
+
+// Function compact_inode_unpack that expands the compact inode record into inode. The block map area past the record's reads as unused direct blocks, and the triple indirect block of a volume without them as 0.
+static void compact_inode_unpack(const compact_inode_t *record, inode_t *inode)
+{
+    const uint8_t *map = record->area + COMPACT_AREA_BYTES - geometry.inode_map_bytes;
+    inode->type = record->type;
+    inode->flags = record->flags;
+    inode->size = record->size;
+    inode->single_indirect = record->single_indirect;
+    inode->double_indirect = record->double_indirect;
+    inode->triple_indirect = 0;
+    if (geometry.triple_indirect)
+    {
+        memcpy(&inode->triple_indirect, record->area, sizeof(uint32_t));
+    }
+    for (int i = 0; i < MAX_DIRECT_BLOCKS; i++)
+    {
+        inode->direct_blocks[i] = MAX_UNIT_32;
+    }
+    memcpy(inode->direct_blocks, map, geometry.inode_map_bytes);
+}
+
+// Function compact_inode_pack that stores inode as a compact inode record. Returns 0 on success and -1 if the inode uses more of its block map area than a record holds, or a triple indirect block on a volume without them.
+static int compact_inode_pack(const inode_t *inode, compact_inode_t *record)
+{
+    uint8_t *map = record->area + COMPACT_AREA_BYTES - geometry.inode_map_bytes;
+    if (inode->flags & INODE_INLINE ? inode->size > INODE_INLINE_LIMIT : inode->flags & INODE_EXTENTS ? inode->extent_header.count > INODE_ROOT_EXTENTS : 0)
+    {
+        return -1;
+    }
+    for (int i = (int)INODE_DIRECT_SLOTS; i < (int)MAX_DIRECT_BLOCKS && !(inode->flags & (INODE_INLINE | INODE_EXTENTS)); i++)
+    {
+        if (inode->direct_blocks[i] != MAX_UNIT_32 && inode->direct_blocks[i] != 0)
+        {
+            return -1;
+        }
+    }
+    if (!geometry.triple_indirect && inode->triple_indirect != 0 && inode->triple_indirect != MAX_UNIT_32)
+    {
+        return -1;
+    }
+
+    record->type = inode->type;
+    record->flags = inode->flags;
+    record->size = inode->size;
+    record->single_indirect = inode->single_indirect;
+    record->double_indirect = inode->double_indirect;
+    if (geometry.triple_indirect)
+    {
+        memcpy(record->area, &inode->triple_indirect, sizeof(uint32_t));
+    }
+    memcpy(map, inode->direct_blocks, geometry.inode_map_bytes);
+    return 0;
+}
+
+// function to read the inode from a segment file. If the inode number is greater than 255 take divisor as a file name number and take the remainder as the inode number. Read the segment file and read the inode from the file. With compact inodes the record is read from its inode block instead. If the file is not found return -1. If the inode is not found return -2. If the inode is found return 0.
+int read_inode(int inode_number, inode_t *inode)
+{
+    int result;
+    if (geometry.inodes_per_block > 1)
+    {
+        compact_inode_t record;
+        result = read_block_at(SEGMENT_KIND_INODE, inode_number / geometry.inodes_per_block, (inode_number % geometry.inodes_per_block) * sizeof(record), &record, sizeof(record));
+        if (result == 0 && record.type == 0)
+        {
+            result = -2;
+        }
+        if (result == 0)
+        {
+            compact_inode_unpack(&record, inode);
+        }
+    }
+    else
+    {
+        result = read_block(SEGMENT_KIND_INODE, inode_number, inode, sizeof(inode_t));
+    }
+    if (result == -1)
+    {
+        perror("Failed to open inode segment file");
+    }
+    return result;
+}
+
+// read data block function that takes a datablock number and read the datablock from the segment file. If the datablock number is greater than 255 take divisor as a file name number and take the remainder as the datablock number. Read the segment file and read the datablock from the file. If the file is not found return -1. If the datablock is not found return -2. If the datablock is found return 0.
+int read_datablock(int datablock_number, datablock_t *datablock)
+{
+    return read_block(SEGMENT_KIND_DATA, datablock_number, datablock, sizeof(datablock_t));
+}
+
+// Inode segment holding inode inode_number
+static uint32_t inode_segment(uint32_t inode_number)
+{
+    return inode_number / geometry.inodes_per_block / geometry.blocks_per_segment;
+}
+
+// Write an updated inode back to its slot in the inode segment, or to its record in its inode block with compact inodes
+int write_inode(int inode_number, inode_t *inode)
+{
+    if (geometry.inodes_per_block > 1)
+    {
+        compact_inode_t record;
+        if (compact_inode_pack(inode, &record) < 0)
+        {
+            fprintf(stderr, "Inode %d does not fit a compact inode\n", inode_number);
+            return -1;
+        }
+        return write_block_at(SEGMENT_KIND_INODE, inode_number / geometry.inodes_per_block, (inode_number % geometry.inodes_per_block) * sizeof(record), &record, sizeof(record));
+    }
+    return write_block(SEGMENT_KIND_INODE, inode_number, inode, sizeof(inode_t));
+}
+
+// Write an updated directory block back to its slot in the data segment
+int write_directory_block(int directory_block_number, directoryblock_t *directory_block)
+{
+    return write_block(SEGMENT_KIND_DATA, directory_block_number, directory_block, sizeof(directoryblock_t));
+}
+
+// Create an inode and save it to a free slot of the inode segments, searching from inode segment goal. With compact inodes the inode takes a free record of the inode block before superblock.next_fit when that block is in the goal segment, and otherwise the first record of a new inode block. Returns the inode number or -1 on failure.
+int create_inode(inode_t *inode, uint32_t goal)
+{
+    if (geometry.inodes_per_block == 1)
+    {
+        return create_block(SEGMENT_KIND_INODE, goal, inode, sizeof(inode_t));
+    }
+
+    compact_inode_t records[geometry.inodes_per_block];
+    memset(records, 0, sizeof(records));
+    if (compact_inode_pack(inode, &records[0]) < 0)
+    {
+        fprintf(stderr, "Inode does not fit a compact inode\n");
+        return -1;
+    }
+
+    uint32_t fill = superblock.next_fit[SEGMENT_KIND_INODE] - 1;
+    if (superblock.next_fit[SEGMENT_KIND_INODE] > 0 && (goal == ALLOC_GOAL_NONE || fill / geometry.blocks_per_segment == goal))
+    {
+        compact_inode_t record;
+        for (uint32_t i = 0; i < geometry.inodes_per_block; i++)
+        {
+            if (read_block_at(SEGMENT_KIND_INODE, fill, i * sizeof(record), &record, sizeof(record)) < 0)
+            {
+                break;
+            }
+            if (record.type == 0)
+            {
+                int inode_number = fill * geometry.inodes_per_block + i;
+                return write_inode(inode_number, inode) < 0 ? -1 : inode_number;
+            }
+        }
+    }
+
+    int block_number = create_block(SEGMENT_KIND_INODE, goal, records, sizeof(records));
+    return block_number < 0 ? -1 : block_number * (int)geometry.inodes_per_block;
+}
+
+// Function create_datablock that stores one block of file data, geometry.block_size bytes, in the first available free block of the data segments
+int create_datablock(const uint8_t *data)
+{
+    return create_block(SEGMENT_KIND_DATA, ALLOC_GOAL_NONE, data, geometry.block_size);
+}
+
+// Function write_reserved_block that fills a block slot claimed with allocate_blocks. The block goes through the cache like a newly created one. Returns 0 on success and -1 on failure.
+int write_reserved_block(int kind, uint32_t block_number, const void *block, size_t size)
+{
+    segment_handle_t *segment = get_segment(kind, block_number / geometry.blocks_per_segment, 0);
+    if (segment == NULL)
+    {
+        return -1;
+    }
+    return store_new_block(kind, block_number, segment, block, size);
+}
+
+// Function create_directoryblock that takes a directoryblock and create a directoryblock in the file system. The directoryblock is created same as the create_datablock function. The difference is that instead of storing the datablock it stores a directory_block. The block is placed near data segment goal. The function returns the index of the directoryblock.
+int create_directoryblock(directoryblock_t *directory_block, uint32_t goal)
+{
+    return create_block(SEGMENT_KIND_DATA, goal, directory_block, sizeof(directoryblock_t));
+}
+
+// Asynchronous block read engine used to stream file data. A batch of block reads is submitted at once through io_uring and the completions are handed to a callback in submission order. When io_uring is unavailable the batch is served by a small pool of pread worker threads instead.
+#ifndef USE_IO_URING
+#define USE_IO_URING 1
+#endif
+#define ASYNC_READ_DEPTH MAX_DIRECTORY_ENTRIES // Reads in flight per batch, one indirect block worth
+#define ASYNC_READ_THREADS 4                   // Worker threads of the fallback pool
+#define ASYNC_READ_PENDING (-EINPROGRESS)      // Result of a read that hasn't completed yet
+
+typedef struct
+{
+    int fd;         // Segment descriptor to read from
+    off_t offset;   // Byte offset of the block in the segment file
+    void *buffer;   // Destination of one block
+    ssize_t result; // Bytes read or -errno once completed
+} async_read_t;
+
+// Called once per read in submission order. Returning a negative value stops the batch.
+typedef int (*async_read_callback_t)(async_read_t *read, int index, void *context);
+
+// A batch split into runs of reads that are adjacent in the same segment file. Each run is moved with one vectored read.
+typedef struct
+{
+    async_read_t *reads;
+    struct iovec iov[ASYNC_READ_DEPTH]; // One vector per read
+    int run_first[ASYNC_READ_DEPTH];    // First read of each run
+    int run_count[ASYNC_READ_DEPTH];    // Number of reads in each run
+    int runs;
+} async_batch_t;
+
+// Spread the result of a vectored read over the reads of its run
+static void complete_run(async_batch_t *batch, int run, ssize_t result)
+{
+    for (int i = 0; i < batch->run_count[run]; i++)
+    {
+        async_read_t *read = &batch->reads[batch->run_first[run] + i];
+        if (result < 0)
+        {
+            read->result = result;
+        }
+        else
+        {
+            ssize_t remaining = result - (ssize_t)i * geometry.block_size;
+            read->result = remaining < 0 ? 0 : (remaining > geometry.block_size ? geometry.block_size : remaining);
+        }
+    }
+}
+
+#if USE_IO_URING && defined(__NR_io_uring_setup)
+static struct
+{
+    int state; // 0 not set up yet, 1 ready, -1 unavailable
+    int fd;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+} uring;
+
+// Set up the io_uring instance used by the engine. Returns 0 on success and -1 if io_uring can't be used.
+static int uring_setup()
+{
+    struct io_uring_params params;
+
+    if (uring.state != 0)
+    {
+        return uring.state > 0 ? 0 : -1;
+    }
+    uring.state = -1;
+
+    memset(&params, 0, sizeof(params));
+    int fd = syscall(__NR_io_uring_setup, ASYNC_READ_DEPTH, &params);
+    if (fd < 0)
+    {
+        return -1;
+    }
+
+    size_t sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    size_t cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP)
+    {
+        sq_size = cq_size = sq_size > cq_size ? sq_size : cq_size;
+    }
+
+    uint8_t *sq = mmap(NULL, sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    uint8_t *cq = sq;
+    if (sq != MAP_FAILED && !(params.features & IORING_FEAT_SINGLE_MMAP))
+    {
+        cq = mmap(NULL, cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+    }
+    struct io_uring_sqe *sqes = mmap(NULL, params.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+    if (sq == MAP_FAILED || cq == MAP_FAILED || sqes == MAP_FAILED)
+    {
+        close(fd);
+        return -1;
+    }
+
+    uring.fd = fd;
+    uring.sq_tail = (unsigned *)(sq + params.sq_off.tail);
+    uring.sq_mask = (unsigned *)(sq + params.sq_off.ring_mask);
+    uring.sq_array = (unsigned *)(sq + params.sq_off.array);
+    uring.cq_head = (unsigned *)(cq + params.cq_off.head);
+    uring.cq_tail = (unsigned *)(cq + params.cq_off.tail);
+    uring.cq_mask = (unsigned *)(cq + params.cq_off.ring_mask);
+    uring.sqes = sqes;
+    uring.cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+    uring.state = 1;
+    return 0;
+}
+
+// Submit every run of the batch with a single io_uring_enter and reap completions as they arrive
+static int uring_read_batch(async_batch_t *batch, int count, async_read_callback_t callback, void *context)
+{
+    async_read_t *reads = batch->reads;
+    unsigned tail = *uring.sq_tail;
+    for (int run = 0; run < batch->runs; run++)
+    {
+        unsigned index = tail & *uring.sq_mask;
+        struct io_uring_sqe *sqe = &uring.sqes[index];
+        memset(sqe, 0, sizeof(*sqe));
+        sqe->opcode = IORING_OP_READV;
+        sqe->fd = reads[batch->run_first[run]].fd;
+        sqe->off = reads[batch->run_first[run]].offset;
+        sqe->addr = (uint64_t)(uintptr_t)&batch->iov[batch->run_first[run]];
+        sqe->len = batch->run_count[run];
+        sqe->user_data = run;
+        uring.sq_array[index] = index;
+        tail++;
+        STAT_INC(async_read_ops);
+    }
+    __atomic_store_n(uring.sq_tail, tail, __ATOMIC_RELEASE);
+
+    int submitted = 0;
+    while (submitted < batch->runs)
+    {
+        int ret = syscall(__NR_io_uring_enter, uring.fd, batch->runs - submitted, 0, 0, NULL, 0);
+        if (ret <= 0)
+        {
+            break;
+        }
+        submitted += ret;
+        STAT_INC(uring_submits);
+    }
+
+    if (submitted < batch->runs)
+    {
+        // Queued entries that weren't consumed must never be submitted later, so stop using the ring
+        uring.state = -1;
+        if (submitted == 0)
+        {
+            return -2; // Nothing in flight, let the caller fall back to the thread pool
+        }
+        for (int run = submitted; run < batch->runs; run++)
+        {
+            complete_run(batch, run, -EIO); // Retried synchronously by the callback wrapper
+        }
+    }
+
+    int completed = 0;
+    int next = 0;
+    int result = 0;
+    while (1)
+    {
+        // Hand every read that is now complete in order to the callback
+        while (next < count && reads[next].result != ASYNC_READ_PENDING)
+        {
+            if (result == 0 && callback(&reads[next], next, context) < 0)
+            {
+                result = -1; // Keep reaping so no read still targets the buffers
+            }
+            next++;
+        }
+
+        if (completed == submitted)
+        {
+            break;
+        }
+
+        unsigned head = *uring.cq_head;
+        if (head == __atomic_load_n(uring.cq_tail, __ATOMIC_ACQUIRE))
+        {
+            syscall(__NR_io_uring_enter, uring.fd, 0, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+            continue;
+        }
+
+        struct io_uring_cqe *cqe = &uring.cqes[head & *uring.cq_mask];
+        complete_run(batch, cqe->user_data, cqe->res);
+        __atomic_store_n(uring.cq_head, head + 1, __ATOMIC_RELEASE);
+        completed++;
+    }
+    return result;
+}
+#endif
+
+static struct
+{
+    int started;
+    pthread_mutex_t lock;
+    pthread_cond_t work; // Signalled when a batch is posted
+    pthread_cond_t done; // Signalled when a run completes
+    async_batch_t *batch;
+    int runs;
+    int next; // Next run to hand to a worker
+} read_pool = {0, PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, PTHREAD_COND_INITIALIZER, NULL, 0, 0};
+
+// Read one run of a batch with a single preadv
+static ssize_t read_run(async_batch_t *batch, int run)
+{
+    struct iovec iov[ASYNC_READ_DEPTH];
+    int first = batch->run_first[run];
+
+    // segment_preadv consumes the vectors, keep the batch's copy intact
+    memcpy(iov, &batch->iov[first], batch->run_count[run] * sizeof(struct iovec));
+    STAT_INC(async_read_ops);
+    ssize_t result = segment_preadv(batch->reads[first].fd, iov, batch->run_count[run], batch->reads[first].offset);
+    return result < 0 ? -errno : result;
+}
+
+static void *read_pool_worker(void *unused)
+{
+    (void)unused;
+
+    pthread_mutex_lock(&read_pool.lock);
+    while (1)
+    {
+        while (read_pool.next >= read_pool.runs)
+        {
+            pthread_cond_wait(&read_pool.work, &read_pool.lock);
+        }
+
+        async_batch_t *batch = read_pool.batch;
+        int run = read_pool.next++;
+        pthread_mutex_unlock(&read_pool.lock);
+
+        ssize_t result = read_run(batch, run);
+
+        pthread_mutex_lock(&read_pool.lock);
+        complete_run(batch, run, result);
+        pthread_cond_broadcast(&read_pool.done);
+    }
+    return NULL;
+}
+
+// Serve a batch with the worker pool, handing completions to the callback in order
+static int pool_read_batch(async_batch_t *batch, int count, async_read_callback_t callback, void *context)
+{
+    async_read_t *reads = batch->reads;
+
+    pthread_mutex_lock(&read_pool.lock);
+    if (!read_pool.started)
+    {
+        for (int i = 0; i < ASYNC_READ_THREADS; i++)
+        {
+            pthread_t thread;
+            if (pthread_create(&thread, NULL, read_pool_worker, NULL) == 0)
+            {
+                pthread_detach(thread);
+                read_pool.started++;
+            }
+        }
+    }
+    int have_workers = read_pool.started > 0;
+    if (have_workers)
+    {
+        read_pool.batch = batch;
+        read_pool.runs = batch->runs;
+        read_pool.next = 0;
+        pthread_cond_broadcast(&read_pool.work);
+    }
+    pthread_mutex_unlock(&read_pool.lock);
+
+    int result = 0;
+    int run = 0;
+    for (int i = 0; i < count; i++)
+    {
+        if (have_workers)
+        {
+            pthread_mutex_lock(&read_pool.lock);
+            while (reads[i].result == ASYNC_READ_PENDING)
+            {
+                pthread_cond_wait(&read_pool.done, &read_pool.lock);
+            }
+            pthread_mutex_unlock(&read_pool.lock);
+        }
+        else if (reads[i].result == ASYNC_READ_PENDING)
+        {
+            // No worker could be started, read the run synchronously
+            while (batch->run_first[run] + batch->run_count[run] <= i)
+            {
+                run++;
+            }
+            complete_run(batch, run, read_run(batch, run));
+        }
+
+        if (result == 0 && callback(&reads[i], i, context) < 0)
+        {
+            result = -1; // Keep waiting so no worker still targets the buffers
+        }
+    }
+
+    if (have_workers)
+    {
+        // Make sure no worker picks up a run of this batch after we return
+        pthread_mutex_lock(&read_pool.lock);
+        read_pool.runs = 0;
+        read_pool.next = 0;
+        pthread_mutex_unlock(&read_pool.lock);
+    }
+    return result;
+}
+
+// Caller callback and context, wrapped so failed or short reads can be fixed up before the caller sees them
+typedef struct
+{
+    async_read_callback_t callback;
+    void *context;
+} async_read_wrap_t;
+
+static int async_read_complete(async_read_t *read, int index, void *context)
+{
+    async_read_wrap_t *wrap = context;
+
+    if (read->result < (ssize_t)geometry.block_size)
+    {
+        ssize_t done = read->result;
+        if (done < 0)
+        {
+            // Retry a failed read synchronously
+            done = segment_pread(read->fd, read->buffer, geometry.block_size, read->offset);
+            if (done <= 0)
+            {
+                return -1;
+            }
+        }
+        memset((uint8_t *)read->buffer + done, 0, geometry.block_size - done);
+        read->result = geometry.block_size;
+    }
+    return wrap->callback(read, index, wrap->context);
+}
+
+// Function async_read_blocks that reads a batch of at most ASYNC_READ_DEPTH blocks concurrently and calls callback for each of them in order as soon as it and all reads before it have completed. Consecutive reads that are adjacent in the same segment file are coalesced into one vectored read. Failed or short reads are retried synchronously and zero filled past end of file. Returns 0 on success and -1 if a read failed or the callback stopped the batch.
+int async_read_blocks(async_read_t *reads, int count, async_read_callback_t callback, void *context)
+{
+    if (count <= 0)
+    {
+        return 0;
+    }
+
+    async_batch_t batch;
+    batch.reads = reads;
+    batch.runs = 0;
+    for (int i = 0; i < count; i++)
+    {
+        reads[i].result = ASYNC_READ_PENDING;
+        batch.iov[i].iov_base = reads[i].buffer;
+        batch.iov[i].iov_len = geometry.block_size;
+
+        // Start a new run unless this read continues the previous one on disk
+        int run = batch.runs - 1;
+        if (run >= 0 && reads[i].fd == reads[i - 1].fd && reads[i].offset == reads[i - 1].offset + geometry.block_size)
+        {
+            batch.run_count[run]++;
+        }
+        else
+        {
+            batch.run_first[batch.runs] = i;
+            batch.run_count[batch.runs] = 1;
+            batch.runs++;
+        }
+    }
+    STAT_INC(async_batches);
+
+    async_read_wrap_t wrap = {callback, context};
+#if USE_IO_URING && defined(__NR_io_uring_setup)
+    if (uring_setup() == 0)
+    {
+        int result = uring_read_batch(&batch, count, async_read_complete, &wrap);
+        if (result != -2)
+        {
+            return result;
+        }
+    }
+#endif
+    return pool_read_batch(&batch, count, async_read_complete, &wrap);
+}
+
+// Function add_directoryentry_to_directoryblock that takes a directoryblock and update its array of directory entires. The function takes in directoryblock and a directory entry and adds that directory entry to the directoryblock. The function returns 0 on success and -1 on failure.
+
+int add_directoryentry_to_directoryblock(uint32_t directoryblock_index, directory_entry_t *entry)
+{
+    directoryblock_t directory_block;
+
+    // Read the existing directory block
+    int result = read_directory_block(directoryblock_index, &directory_block);
+    if (result < 0)
+    {
+        return result; // Failed to read the directory block
+    }
+
+    // Check if there's space for a new entry
+    for (int i = 0; i < BLOCK_SIZE / sizeof(directory_entry_t); i++)
+    {
+        if (directory_block.entries[i].inuse != 1)
+        {
+            // Add the new entry to the first empty slot
+            directory_block.entries[i] = *entry;
+
+            // Update the directory block in the file
+            if (write_directory_block(directoryblock_index, &directory_block) < 0)
+            {
+                return -1;
+            }
+
+            return 0; // Success
+        }
+    }
+
+    return -1; // Directory block is full
+}
+
+// Function create_directory that takes a directory name and create a directory in the file system. The directory is created by creating a datablock and writing the directory name to the datablock. The datablock is then saved to the first available free block in an available segment. The function returns the index of the datablock. The second paramter is the inode number of the parent directory. The function creates a directory entry in the parent directory for the new directory. If the second parameter is not provided then the parent directory is set to have inode number 0. The function returns the index of the datablock.
+// It creates a directory entry in the parent directory for the new directory. If the second parameter is not provided then the parent directory is set to have inode number 0. The function returns the index of the datablock.
+int create_directory(const char *directory_name, int parent_inode_number)
+{
+    directoryblock_t directory_block;
+    uint32_t block_count = 0;
+
+    // Create a new directory entry
+    directory_entry_t new_entry;
+    strncpy(new_entry.name, directory_name, sizeof(new_entry.name) - 1);
+    new_entry.name[sizeof(new_entry.name) - 1] = '\0'; // Ensure null termination
+    new_entry.inode_number = 0;                        // Placeholder for inode number
+    new_entry.type = FILE_TYPE_DIRECTORY;              // Directory type
+    new_entry.inuse = 1;                               // Mark as in-use
+
+    // Initialize the directory block
+    memset(&directory_block, 0, sizeof(directoryblock_t));
+    memcpy(&directory_block.entries[0], &new_entry, sizeof(directory_entry_t));
+
+    // Create a datablock and store its index
+    int directoryblock_index = create_directoryblock(&directory_block, ALLOC_GOAL_NONE);
+    if (directoryblock_index < 0)
+    {
+        perror("Failed to create datablock");
+        return -1;
+    }
+
+    // Save the datablock index in the parent inode's direct blocks
+    if (parent_inode_number > 0)
+    {
+        inode_t parent_inode;
+        if (read_inode(parent_inode_number, &parent_inode) != 0)
+        {
+            perror("Failed to read parent inode");
+            return -1;
+        }
+
+        for (int i = 0; i < MAX_DIRECT_BLOCKS; i++)
+        {
+            if (parent_inode.direct_blocks[i] == 0)
+            {
+                parent_inode.direct_blocks[i] = directoryblock_index;
+                break;
+            }
+        }
+
+        // Update the parent inode in the segment file
+        if (write_inode(parent_inode_number, &parent_inode) < 0)
+        {
+            perror("Failed to write parent inode");
+            return -1;
+        }
+    }
+
+    return directoryblock_index; // Return the index of the created datablock
+}
+
+// Function read_pointers that reads the block numbers held by indirect block block_number of inode into pointers, which has room for POINTERS_PER_BLOCK of them, and returns how many there are, or -1 on failure. Indirect blocks of INODE_POINTER_ARRAYS inodes are flat arrays; those of older inodes are directory entries, one in use per block number.
+static int read_pointers(const inode_t *inode, uint32_t block_number, uint32_t *pointers)
+{
+    int count = 0;
+    if (inode->flags & INODE_POINTER_ARRAYS)
+    {
+        if (read_block(SEGMENT_KIND_DATA, block_number, pointers, geometry.block_size) < 0)
+        {
+            return -1;
+        }
+        for (uint32_t i = 0; i < POINTERS_PER_BLOCK; i++)
+        {
+            if (pointers[i] != MAX_UNIT_32)
+            {
+                pointers[count++] = pointers[i];
+            }
+        }
+        return count;
+    }
+
+    directoryblock_t indirect_block;
+    if (read_directory_block(block_number, &indirect_block) < 0)
+    {
+        return -1;
+    }
+    for (int i = 0; i < MAX_DIRECTORY_ENTRIES; i++)
+    {
+        if (indirect_block.entries[i].inuse == 1)
+        {
+            pointers[count++] = indirect_block.entries[i].inode_number;
+        }
+    }
+    return count;
+}
+
+// Function extent_search that returns the index of the last of count records, sorted by logical block, that starts at or before logical, or -1 if there is none. The records are binary searched.
+static int extent_search(const extent_t *records, uint32_t count, uint32_t logical)
+{
+    int low = 0;
+    int high = (int)count - 1;
+    int found = -1;
+    while (low <= high)
+    {
+        int middle = (low + high) / 2;
+        if (records[middle].logical <= logical)
+        {
+            found = middle;
+            low = middle + 1;
+        }
+        else
+        {
+            high = middle - 1;
+        }
+    }
+    return found;
+}
+
+// Function read_extent_node that reads extent-tree block block_number into node, a buffer of block_size bytes holding an extent_header_t and its records. Returns 0 on success and -1 on failure.
+static int read_extent_node(uint32_t block_number, uint8_t *node)
+{
+    if (read_block(SEGMENT_KIND_DATA, block_number, node, geometry.block_size) < 0)
+    {
+        return -1;
+    }
+    return ((extent_header_t *)node)->count <= EXTENTS_PER_BLOCK ? 0 : -1;
+}
+
+// Function map_file_block that returns the block holding logical block logical of an INODE_EXTENTS file, and in run how many blocks from there on are stored consecutively in the same extent. Every level of the extent tree is binary searched, so a lookup costs O(log n) in the number of extents. Returns MAX_UNIT_32 if the block is not mapped.
+static uint32_t map_file_block(const inode_t *inode, uint32_t logical, uint32_t *run)
+{
+    uint8_t node[geometry.block_size];
+    extent_header_t header = inode->extent_header;
+    const extent_t *records = inode->extents;
+
+    while (1)
+    {
+        int i = extent_search(records, header.count, logical);
+        if (i < 0)
+        {
+            return MAX_UNIT_32;
+        }
+        if (header.depth == 0)
+        {
+            uint32_t offset = logical - records[i].logical;
+            if (offset >= records[i].length)
+            {
+                return MAX_UNIT_32;
+            }
+            *run = records[i].length - offset;
+            return records[i].physical + offset;
+        }
+
+        if (read_extent_node(records[i].physical, node) < 0)
+        {
+            return MAX_UNIT_32;
+        }
+        header = *(extent_header_t *)node;
+        records = (const extent_t *)(node + sizeof(extent_header_t));
+    }
+}
+
+// Function map_file_range that appends the blocks holding the logical blocks of an INODE_EXTENTS file from list->count up to end to list, one map_file_block lookup per extent. Returns 0 on success and -1 on failure.
+static int map_file_range(const inode_t *inode, block_list_t *list, uint32_t end)
+{
+    while ((uint32_t)list->count < end)
+    {
+        uint32_t run;
+        uint32_t block_number = map_file_block(inode, list->count, &run);
+        if (block_number == MAX_UNIT_32)
+        {
+            fprintf(stderr, "Block %d of the file is not mapped\n", list->count);
+            return -1;
+        }
+        for (uint32_t i = 0; i < run && (uint32_t)list->count < end; i++)
+        {
+            if (block_list_append(list, block_number + i) < 0)
+            {
+                return -1;
+            }
+        }
+    }
+    return 0;
+}
+
+// Function collect_extent_nodes that appends the extent-tree blocks below count records of a node of depth depth to nodes. Returns 0 on success and -1 on failure.
+static int collect_extent_nodes(const extent_t *records, uint32_t count, uint32_t depth, block_list_t *nodes)
+{
+    if (depth == 0)
+    {
+        return 0;
+    }
+
+    uint8_t node[geometry.block_size];
+    for (uint32_t i = 0; i < count; i++)
+    {
+        if (block_list_append(nodes, records[i].physical) < 0 || read_extent_node(records[i].physical, node) < 0)
+        {
+            return -1;
+        }
+        extent_header_t *header = (extent_header_t *)node;
+        if (collect_extent_nodes((extent_t *)(node + sizeof(extent_header_t)), header->count, header->depth, nodes) < 0)
+        {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// Function write_extent_tree that roots the count extents in runs, sorted by logical block, in inode. Up to INODE_ROOT_EXTENTS records are kept in the inode itself. More are written to extent-tree blocks of EXTENTS_PER_BLOCK records each, claimed near data segment goal, with a level of index records above them, and so on until the top level fits in the inode. The inode is marked INODE_EXTENTS. Returns 0 on success and -1 on failure, in which case the extent-tree blocks are released.
+static int write_extent_tree(inode_t *inode, const extent_t *runs, uint32_t count, uint32_t goal)
+{
+    extent_t *records = malloc((count + 1) * sizeof(extent_t));
+    if (records == NULL)
+    {
+        return -1;
+    }
+    memcpy(records, runs, count * sizeof(extent_t));
+
+    // Push the records down into extent-tree blocks until the top level fits in the inode. Index record n replaces record n, which node 0 has already taken.
+    uint8_t node[geometry.block_size];
+    block_list_t nodes = {NULL, 0, 0};
+    uint32_t depth = 0;
+    int result = 0;
+    while (count > INODE_ROOT_EXTENTS && result == 0)
+    {
+        uint32_t per_node = EXTENTS_PER_BLOCK;
+        uint32_t node_count = (count + per_node - 1) / per_node;
+        uint32_t first = nodes.count;
+        for (uint32_t n = 0; n < node_count && result == 0; n++)
+        {
+            result = block_list_append(&nodes, 0);
+        }
+        if (result < 0 || allocate_blocks(SEGMENT_KIND_DATA, node_count, goal, nodes.blocks + first) < 0)
+        {
+            nodes.count = first;
+            result = -1;
+            break;
+        }
+
+        for (uint32_t n = 0; n < node_count && result == 0; n++)
+        {
+            extent_header_t *header = (extent_header_t *)node;
+            memset(node, 0, sizeof(node));
+            header->count = count - n * per_node < per_node ? count - n * per_node : per_node;
+            header->depth = depth;
+            memcpy(node + sizeof(extent_header_t), records + n * per_node, header->count * sizeof(extent_t));
+            result = write_reserved_block(SEGMENT_KIND_DATA, nodes.blocks[first + n], node, geometry.block_size);
+
+            extent_t index = {records[n * per_node].logical, nodes.blocks[first + n], 0};
+            records[n] = index;
+        }
+        count = node_count;
+        depth++;
+    }
+
+    if (result == 0)
+    {
+        memset(inode->direct_blocks, 0, sizeof(inode->direct_blocks));
+        inode->extent_header.count = count;
+        inode->extent_header.depth = depth;
+        memcpy(inode->extents, records, count * sizeof(extent_t));
+        inode->single_indirect = MAX_UNIT_32;
+        inode->double_indirect = MAX_UNIT_32;
+        inode->triple_indirect = MAX_UNIT_32;
+        inode->flags = (inode->flags & ~INODE_POINTER_ARRAYS) | INODE_EXTENTS;
+    }
+    else
+    {
+        release_blocks(SEGMENT_KIND_DATA, nodes.blocks, nodes.count);
+    }
+
+    free(nodes.blocks);
+    free(records);
+    return result < 0 ? -1 : 0;
+}
+
+// Levels of indirect blocks a file mapped with block pointers can have: single, double and triple indirect
+#define MAX_INDIRECT_DEPTH 3
+
+// Streaming builder of the block map of a file. Data blocks are added in logical order as they are written and the map grows with them. With block pointers every indirect block is written as soon as it is full, so only the one being filled at each level is held in memory; with extents only the runs found so far are. Memory stays bounded by the depth of the map or the number of extents, not by the size of the file.
+typedef struct
+{
+    inode_t *inode;
+    uint32_t goal;                        // Data segment new indirect and extent-tree blocks are claimed near, following the data
+    uint32_t count;                       // Data blocks added so far
+    int extents;                          // Map with extents instead of block pointers
+    int depth;                            // Levels of indirect blocks, 0 when the direct blocks are enough
+    uint32_t *levels[MAX_INDIRECT_DEPTH]; // The indirect block being filled at each level, level 0 pointing at data blocks
+    uint32_t filled[MAX_INDIRECT_DEPTH];  // Block numbers held by each of them
+    extent_t *records;                    // The runs found so far
+    uint32_t record_count;
+    uint32_t record_capacity;
+} map_builder_t;
+
+// Function map_builder_release that frees the memory of a builder
+static void map_builder_release(map_builder_t *builder)
+{
+    for (int level = 0; level < MAX_INDIRECT_DEPTH; level++)
+    {
+        free(builder->levels[level]);
+        builder->levels[level] = NULL;
+    }
+    free(builder->records);
+    builder->records = NULL;
+}
+
+// Buffers for walking down the indirect blocks of a file mapped with block pointers. Each level of the tree reads into its own block, allocated once for the whole walk, so the recursion holds one path from the top indirect block to the data and keeps nothing on the stack.
+typedef struct
+{
+    uint32_t *levels[MAX_INDIRECT_DEPTH]; // The indirect block being read at each level, level 0 pointing at data blocks
+} pointer_walk_t;
+
+// Function pointer_walk_release that frees the buffers of a walk
+static void pointer_walk_release(pointer_walk_t *walk)
+{
+    for (int level = 0; level < MAX_INDIRECT_DEPTH; level++)
+    {
+        free(walk->levels[level]);
+        walk->levels[level] = NULL;
+    }
+}
+
+// Function pointer_walk_init that allocates the buffers of a walk down from an indirect block depth levels above the data. Returns 0 on success and -1 if memory runs out.
+static int pointer_walk_init(pointer_walk_t *walk, int depth)
+{
+    memset(walk, 0, sizeof(*walk));
+    for (int level = 0; level < depth && level < MAX_INDIRECT_DEPTH; level++)
+    {
+        walk->levels[level] = malloc(geometry.block_size);
+        if (walk->levels[level] == NULL)
+        {
+            pointer_walk_release(walk);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// Function map_builder_init that starts the block map of inode for a file of block_count data blocks, with extents if extents is set and block pointers otherwise. Files that fit the direct blocks need no indirect block, USE_SINGLE_INDIRECT files up to POINTERS_PER_BLOCK blocks a single indirect block, and larger files a double or, beyond 4GB with 4KB blocks, a triple indirect block. Returns 0 on success and -1 if the file is too large even for triple indirect blocks or memory runs out.
+static int map_builder_init(map_builder_t *builder, inode_t *inode, uint32_t block_count, uint32_t goal, int extents)
+{
+    uint64_t fanout = INDIRECT_FANOUT;
+
+    memset(builder, 0, sizeof(*builder));
+    builder->inode = inode;
+    builder->goal = goal;
+    builder->extents = extents;
+    inode->single_indirect = MAX_UNIT_32;
+    inode->double_indirect = MAX_UNIT_32;
+    inode->triple_indirect = MAX_UNIT_32;
+    for (int i = 0; i < MAX_DIRECT_BLOCKS; i++)
+    {
+        inode->direct_blocks[i] = MAX_UNIT_32;
+    }
+    if (extents)
+    {
+        return 0;
+    }
+
+    if (USE_SINGLE_INDIRECT && block_count <= fanout)
+    {
+        builder->depth = 1;
+    }
+    else if (!USE_SINGLE_INDIRECT && block_count <= INODE_DIRECT_SLOTS)
+    {
+        builder->depth = 0;
+    }
+    else if (block_count <= fanout * fanout)
+    {
+        builder->depth = 2;
+    }
+    else if (block_count <= fanout * fanout * fanout && geometry.triple_indirect)
+    {
+        builder->depth = 3;
+    }
+    else
+    {
+        fprintf(stderr, geometry.triple_indirect ? "File too large even for triple indirect blocks\n" : "File too large for double indirect blocks, the largest this volume maps\n");
+        return -1;
+    }
+
+    inode->flags = (inode->flags & ~INODE_EXTENTS) | INODE_POINTER_ARRAYS;
+    for (int level = 0; level < builder->depth; level++)
+    {
+        builder->levels[level] = malloc(geometry.block_size);
+        if (builder->levels[level] == NULL)
+        {
+            map_builder_release(builder);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static int map_builder_push(map_builder_t *builder, int level, uint32_t block_number);
+
+// Function map_builder_flush that writes the indirect block being filled at level to a newly claimed block, unused slots holding MAX_UNIT_32, and adds it to the level above, or points the inode at it from the top level. Returns 0 on success and -1 on failure.
+static int map_builder_flush(map_builder_t *builder, int level)
+{
+    uint32_t *pointers = builder->levels[level];
+    for (uint32_t i = builder->filled[level]; i < POINTERS_PER_BLOCK; i++)
+    {
+        pointers[i] = MAX_UNIT_32;
+    }
+
+    uint32_t block_number;
+    if (allocate_blocks(SEGMENT_KIND_DATA, 1, builder->goal, &block_number) < 0)
+    {
+        return -1;
+    }
+    if (write_reserved_block(SEGMENT_KIND_DATA, block_number, pointers, geometry.block_size) < 0)
+    {
+        release_blocks(SEGMENT_KIND_DATA, &block_number, 1);
+        return -1;
+    }
+    builder->filled[level] = 0;
+
+    if (level + 1 < builder->depth)
+    {
+        return map_builder_push(builder, level + 1, block_number);
+    }
+    uint32_t *top = builder->depth == 1 ? &builder->inode->single_indirect : builder->depth == 2 ? &builder->inode->double_indirect : &builder->inode->triple_indirect;
+    *top = block_number;
+    return 0;
+}
+
+// Function map_builder_push that adds block_number to the indirect block being filled at level, writing it out once it is full. The top level is only written by map_builder_finish. Returns 0 on success and -1 on failure.
+static int map_builder_push(map_builder_t *builder, int level, uint32_t block_number)
+{
+    builder->levels[level][builder->filled[level]++] = block_number;
+    if (builder->filled[level] < INDIRECT_FANOUT || level + 1 == builder->depth)
+    {
+        return 0;
+    }
+    return map_builder_flush(builder, level);
+}
+
+// Function map_builder_add that appends count data blocks, the next ones of the file in logical order, to the map. Returns 0 on success and -1 on failure, in which case the blocks from builder->count on were not added.
+static int map_builder_add(map_builder_t *builder, const uint32_t *blocks, uint32_t count)
+{
+    for (uint32_t i = 0; i < count; i++)
+    {
+        if (builder->extents)
+        {
+            extent_t *last = builder->record_count > 0 ? &builder->records[builder->record_count - 1] : NULL;
+            if (last != NULL && blocks[i] == last->physical + last->length)
+            {
+                last->length++;
+                builder->count++;
+                continue;
+            }
+            if (builder->record_count == builder->record_capacity)
+            {
+                uint32_t capacity = builder->record_capacity > 0 ? builder->record_capacity * 2 : 16;
+                extent_t *grown = realloc(builder->records, capacity * sizeof(extent_t));
+                if (grown == NULL)
+                {
+                    return -1;
+                }
+                builder->records = grown;
+                builder->record_capacity = capacity;
+            }
+            extent_t run = {builder->count, blocks[i], 1};
+            builder->records[builder->record_count++] = run;
+            builder->count++;
+        }
+        else if (builder->depth == 0)
+        {
+            builder->inode->direct_blocks[builder->count++] = blocks[i];
+        }
+        else
+        {
+            builder->count++;
+            if (map_builder_push(builder, 0, blocks[i]) < 0)
+            {
+                return -1;
+            }
+        }
+    }
+
+    if (count > 0)
+    {
+        builder->goal = blocks[count - 1] / geometry.blocks_per_segment;
+    }
+    return 0;
+}
+
+// Function map_builder_finish that writes out the rest of the map, the partly filled indirect blocks from the bottom level up or the extent tree, and frees the builder. Returns 0 on success and -1 on failure, in which case the builder is left for map_builder_abort.
+static int map_builder_finish(map_builder_t *builder)
+{
+    int result = 0;
+    if (builder->extents)
+    {
+        result = write_extent_tree(builder->inode, builder->records, builder->record_count, builder->goal);
+    }
+    for (int level = 0; level < builder->depth && result == 0; level++)
+    {
+        if (builder->filled[level] > 0 || level + 1 == builder->depth)
+        {
+            result = map_builder_flush(builder, level);
+        }
+    }
+
+    if (result == 0)
+    {
+        map_builder_release(builder);
+    }
+    return result;
+}
+
+// Function free_pointer_level that frees block block_number, level levels above the data, and the indirect blocks below it, reading each level into its buffer of walk. Data blocks, at level 0, are freed only if free_data is set.
+static void free_pointer_level(pointer_walk_t *walk, uint32_t block_number, int level, int free_data)
+{
+    if (level == 0)
+    {
+        if (free_data)
+        {
+            free_block(SEGMENT_KIND_DATA, block_number);
+        }
+        return;
+    }
+
+    uint32_t *pointers = walk->levels[level - 1];
+    if (read_block(SEGMENT_KIND_DATA, block_number, pointers, geometry.block_size) == 0)
+    {
+        for (uint32_t i = 0; i < POINTERS_PER_BLOCK; i++)
+        {
+            if (pointers[i] != MAX_UNIT_32)
+            {
+                free_pointer_level(walk, pointers[i], level - 1, free_data);
+            }
+        }
+    }
+    free_block(SEGMENT_KIND_DATA, block_number);
+}
+
+// Function free_pointer_tree that frees an indirect block written by a map builder and the indirect blocks below it, level levels above the data. The data blocks at the bottom are freed too if free_data is set. If memory runs out only the block itself is freed.
+static void free_pointer_tree(uint32_t block_number, int level, int free_data)
+{
+    pointer_walk_t walk;
+    if (pointer_walk_init(&walk, level) < 0)
+    {
+        free_block(SEGMENT_KIND_DATA, block_number);
+        return;
+    }
+    free_pointer_level(&walk, block_number, level, free_data);
+    pointer_walk_release(&walk);
+}
+
+// Function map_builder_abort that gives up on a map: the indirect blocks written so far are freed, and the data blocks added so far too if free_data is set. The builder is freed.
+static void map_builder_abort(map_builder_t *builder, int free_data)
+{
+    if (builder->extents && free_data)
+    {
+        for (uint32_t i = 0; i < builder->record_count; i++)
+        {
+            for (uint32_t j = 0; j < builder->records[i].length; j++)
+            {
+                free_block(SEGMENT_KIND_DATA, builder->records[i].physical + j);
+            }
+        }
+    }
+    else if (!builder->extents && builder->depth == 0 && free_data)
+    {
+        for (uint32_t i = 0; i < builder->count; i++)
+        {
+            free_block(SEGMENT_KIND_DATA, builder->inode->direct_blocks[i]);
+        }
+    }
+
+    for (int level = 0; level < builder->depth; level++)
+    {
+        for (uint32_t i = 0; i < builder->filled[level]; i++)
+        {
+            free_pointer_tree(builder->levels[level][i], level, free_data);
+        }
+    }
+    map_builder_release(builder);
+}
+
+// Function write_file_extents that maps the block_count data blocks of a file, listed in logical order in blocks, with extents: one record per run of consecutive block numbers, so a file allocated in one piece needs a single record (see write_extent_tree). Returns 0 on success and -1 on failure, in which case the extent-tree blocks are released.
+static int write_file_extents(inode_t *inode, const uint32_t *blocks, uint32_t block_count, uint32_t goal)
+{
+    map_builder_t builder;
+    map_builder_init(&builder, inode, block_count, goal, 1);
+    if (map_builder_add(&builder, blocks, block_count) < 0 || map_builder_finish(&builder) < 0)
+    {
+        map_builder_abort(&builder, 0);
+        return -1;
+    }
+    return 0;
+}
+
+static void free_file_blocks(inode_t *inode);
+
+// Function that takes a file path and create a inode for that file and save it to the first available free block in an available segment. The data is streamed a segment's worth of blocks at a time, each chunk claimed in one batch with allocate_blocks after the previous one so the file lands in as few contiguous runs as free space allows, and handed to a map_builder_t that writes the indirect blocks as they fill. Every data block and every indirect block is written exactly once, and memory use does not grow with the size of the file. The inode is placed near inode segment inode_goal and the blocks near data segment data_goal.
+int create_inode_for_file(const char *file_path, uint32_t inode_goal, uint32_t data_goal)
+{
+    inode_t inode;
+
+    inode.type = FILE_TYPE_REGULAR; // Regular file
+    inode.flags = 0;
+    inode.single_indirect = MAX_UNIT_32;
+    inode.double_indirect = MAX_UNIT_32;
+    inode.triple_indirect = MAX_UNIT_32;
+    for (int i = 0; i < MAX_DIRECT_BLOCKS; i++)
+    {
+        inode.direct_blocks[i] = MAX_UNIT_32;
+    }
+
+    uint8_t datablock[geometry.block_size];
+    uint32_t block_count = 0;
+
+    // Reading the actual file data
+    FILE *file = fopen(file_path, "rb");
+    if (file == NULL)
+    {
+        perror("Failed to open file");
+        return -1;
+    }
+
+    // Get file size
+    fseek(file, 0, SEEK_END);
+    inode.size = ftell(file);
+    fseek(file, 0, SEEK_SET);
+
+    // A small file goes into the inode with its data, no data block is claimed
+    if (USE_INLINE_DATA && inode.size <= INODE_INLINE_LIMIT)
+    {
+        memset(inode.inline_data, 0, sizeof(inode.inline_data));
+        if (fread(inode.inline_data, 1, inode.size, file) != inode.size)
+        {
+            perror("Failed to read file");
+            fclose(file);
+            return -1;
+        }
+        fclose(file);
+        inode.flags = INODE_INLINE;
+
+        int inode_index = create_inode(&inode, inode_goal);
+        if (inode_index < 0)
+        {
+            perror("Failed to create inode");
+        }
+        return inode_index;
+    }
+
+    // Calculate how many blocks we need
+    block_count = (inode.size + geometry.block_size - 1) / geometry.block_size; // Ceiling division
+
+    map_builder_t builder;
+    if (map_builder_init(&builder, &inode, block_count, data_goal, USE_EXTENTS) < 0)
+    {
+        fclose(file);
+        return -1;
+    }
+
+    // Read file data in chunks into datablocks claimed a chunk at a time, each chunk following the one before. A chunk fills a segment, so every chunk but the last takes a whole free run of one.
+    uint32_t chunk_blocks = geometry.blocks_per_segment;
+    uint32_t *chunk = malloc(chunk_blocks * sizeof(uint32_t));
+    uint32_t goal = data_goal;
+    int result = chunk != NULL ? 0 : -1;
+    for (uint32_t done = 0; done < block_count && result == 0; done += chunk_blocks)
+    {
+        uint32_t count = block_count - done < chunk_blocks ? block_count - done : chunk_blocks;
+        if (allocate_blocks(SEGMENT_KIND_DATA, count, goal, chunk) < 0)
+        {
+            fprintf(stderr, "Failed to allocate blocks for file\n");
+            result = -1;
+            break;
+        }
+
+        for (uint32_t i = 0; i < count && result == 0; i++)
+        {
+            memset(datablock, 0, sizeof(datablock));
+            fread(datablock, 1, sizeof(datablock), file);
+            result = write_reserved_block(SEGMENT_KIND_DATA, chunk[i], datablock, sizeof(datablock));
+        }
+        if (result < 0)
+        {
+            perror("Failed to create datablock");
+            release_blocks(SEGMENT_KIND_DATA, chunk, count);
+            break;
+        }
+
+        // Each indirect block is built in memory and written once, as soon as it is full
+        uint32_t added = builder.count;
+        result = map_builder_add(&builder, chunk, count);
+        if (result < 0)
+        {
+            added = builder.count - added;
+            release_blocks(SEGMENT_KIND_DATA, chunk + added, count - added);
+        }
+        goal = chunk[count - 1] / geometry.blocks_per_segment;
+    }
+    fclose(file);
+    free(chunk);
+
+    // Point the inode at the data, writing the rest of the indirect blocks or the extent tree
+    if (result == 0)
+    {
+        result = map_builder_finish(&builder);
+    }
+    if (result < 0)
+    {
+        fprintf(stderr, "Failed to store file\n");
+        map_builder_abort(&builder, 1);
+        return -1;
+    }
+
+    int inode_index = create_inode(&inode, inode_goal);
+    if (inode_index < 0)
+    {
+        perror("Failed to create inode");
+        free_file_blocks(&inode);
+        return -1;
+    }
+
+    return inode_index;
+}
+
+int find_entry_in_directory(directoryblock_t *dir_block, const char *name, directory_entry_t **found_entry)
+{
+    for (int i = 0; i < MAX_DIRECTORY_ENTRIES; i++)
+    {
+        if (dir_block->entries[i].inuse == 1 && strcmp(dir_block->entries[i].name, name) == 0)
+        {
+            *found_entry = &dir_block->entries[i];
+            return i; // Return index if found
+        }
+    }
+    *found_entry = NULL;
+    return -1; // Not found
+}
+
+// Split a path into segments and return the count of segments
+int split_path(const char *path, char *segments[], int max_segments)
+{
+    char path_copy[256]; // Create a copy since strtok modifies the string
+    strncpy(path_copy, path, sizeof(path_copy) - 1);
+    path_copy[sizeof(path_copy) - 1] = '\0'; // Ensure null termination
+
+    int segment_count = 0;
+    char *segment = strtok(path_copy, "/");
+
+    while (segment != NULL && segment_count < max_segments)
+    {
+        segments[segment_count++] = strdup(segment);
+        segment = strtok(NULL, "/");
+    }
+    segments[segment_count] = NULL;
+
+    return segment_count;
+}
+
+
+// Function block_list_run that returns the length of the extent starting at entry start of a block list, the number of following entries up to end that continue it with consecutive block numbers in the same segment. Files stored with allocate_extent come back as a few long runs that are read sequentially.
+static int block_list_run(const block_list_t *list, int start, int end)
+{
+    uint32_t first = list->blocks[start];
+    int run = 1;
+    while (start + run < end && list->blocks[start + run] == first + run && first / geometry.blocks_per_segment == list->blocks[start + run] / geometry.blocks_per_segment)
+    {
+        run++;
+    }
+    return run;
+}
+
+// Function collect_pointer_level that appends the data block numbers below indirect block block_number of inode, level levels above the data, to list in logical order, reading each level into its buffer of walk. Returns 0 on success and -1 on failure.
+static int collect_pointer_level(pointer_walk_t *walk, const inode_t *inode, uint32_t block_number, int level, block_list_t *list)
+{
+    uint32_t *pointers = walk->levels[level - 1];
+    int count = read_pointers(inode, block_number, pointers);
+    if (count < 0)
+    {
+        fprintf(stderr, "Failed to read indirect block\n");
+        return -1;
+    }
+
+    for (int m = 0; m < count; m++)
+    {
+        if ((level == 1 ? block_list_append(list, pointers[m]) : collect_pointer_level(walk, inode, pointers[m], level - 1, list)) < 0)
+        {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// Function collect_pointer_tree that appends the data block numbers below indirect block block_number of inode, level levels above the data, to list in logical order. Returns 0 on success and -1 on failure.
+static int collect_pointer_tree(const inode_t *inode, uint32_t block_number, int level, block_list_t *list)
+{
+    pointer_walk_t walk;
+    if (pointer_walk_init(&walk, level) < 0)
+    {
+        return -1;
+    }
+    int result = collect_pointer_level(&walk, inode, block_number, level, list);
+    pointer_walk_release(&walk);
+    return result;
+}
+
+// Function collect_file_blocks that appends the data block numbers of a regular file to list in logical order, following its extent tree or its direct, single, double or triple indirect mapping. An INODE_INLINE file has none. The list must start out empty for an extent-mapped file. Returns 0 on success and -1 on failure.
+static int collect_file_blocks(inode_t *inode, block_list_t *list)
+{
+    if (inode->flags & INODE_INLINE)
+    {
+        return 0;
+    }
+    else if (inode->flags & INODE_EXTENTS)
+    {
+        return map_file_range(inode, list, list->count + (inode->size + geometry.block_size - 1) / geometry.block_size);
+    }
+    else if (inode->triple_indirect != 0 && inode->triple_indirect != MAX_UNIT_32)
+    {
+        return collect_pointer_tree(inode, inode->triple_indirect, 3, list);
+    }
+    else if (inode->double_indirect != MAX_UNIT_32)
+    {
+        return collect_pointer_tree(inode, inode->double_indirect, 2, list);
+    }
+    else if (inode->single_indirect != MAX_UNIT_32)
+    {
+        return collect_pointer_tree(inode, inode->single_indirect, 1, list);
+    }
+    else
+    {
+        for (int m = 0; m < (int)MAX_DIRECT_BLOCKS && inode->direct_blocks[m] != MAX_UNIT_32; m++)
+        {
+            if (block_list_append(list, inode->direct_blocks[m]) < 0)
+            {
+                return -1;
+            }
+        }
+    }
+
+    return 0;
+}
+
+// Sequential readahead for extract_file. Before each batch is read, the kernel is told with posix_fadvise (or madvise for mapped segments) about the block ranges that follow it. The window is sized from the observed throughput so that hints run roughly READAHEAD_TARGET_MS ahead of consumption.
+#define READAHEAD_MIN_BLOCKS ((int)ASYNC_READ_DEPTH)       // 512 KB
+#define READAHEAD_MAX_BLOCKS (16 * (int)ASYNC_READ_DEPTH) // 8 MB
+#define READAHEAD_TARGET_MS 20
+
+typedef struct
+{
+    int advised_until; // Position in the block list up to which hints have been issued
+    int window;        // Blocks hinted beyond the batch being read
+    double throughput; // Observed blocks per second, smoothed
+} readahead_t;
+
+// Hint a run of count adjacent blocks starting at block_number
+static void readahead_hint(uint32_t block_number, int count)
+{
+    segment_handle_t *segment = get_segment(SEGMENT_KIND_DATA, block_number / geometry.blocks_per_segment, 0);
+    if (segment == NULL)
+    {
+        return;
+    }
+
+    off_t offset = segment_offset(segment, block_number % geometry.blocks_per_segment);
+    size_t length = (size_t)count * geometry.block_size;
+
+    if (segment->map != NULL)
+    {
+        madvise(segment->map + (offset - segment->base), length, MADV_WILLNEED);
+    }
+    else
+    {
+        posix_fadvise(segment->fd, offset, length, POSIX_FADV_WILLNEED);
+    }
+    STAT_INC(readahead_hints);
+}
+
+// Issue hints for every block up to the end of the window after position, grouping adjacent blocks of a segment into one hint
+static void readahead_advance(readahead_t *readahead, block_list_t *list, int position)
+{
+    int target = position + readahead->window < list->count ? position + readahead->window : list->count;
+    int i = readahead->advised_until > position - (int)ASYNC_READ_DEPTH ? readahead->advised_until : position - (int)ASYNC_READ_DEPTH;
+    if (i < 0)
+    {
+        i = 0;
+    }
+
+    while (i < target)
+    {
+        int run = block_list_run(list, i, target);
+        readahead_hint(list->blocks[i], run);
+        i += run;
+    }
+
+    if (target > readahead->advised_until)
+    {
+        readahead->advised_until = target;
+    }
+}
+
+// Resize the window from the time it took to consume the last batch
+static void readahead_update(readahead_t *readahead, int blocks, double seconds)
+{
+    if (seconds <= 0)
+    {
+        readahead->window = READAHEAD_MAX_BLOCKS;
+        return;
+    }
+
+    double sample = blocks / seconds;
+    readahead->throughput = readahead->throughput > 0 ? (readahead->throughput + sample) / 2 : sample;
+
+    int window = readahead->throughput * READAHEAD_TARGET_MS / 1000;
+    readahead->window = window < READAHEAD_MIN_BLOCKS ? READAHEAD_MIN_BLOCKS : (window > READAHEAD_MAX_BLOCKS ? READAHEAD_MAX_BLOCKS : window);
+}
+
+// Context of stream_file_blocks handed to the async read callback
+typedef struct
+{
+    uint32_t first_index; // Logical index in the file of the first block of the batch
+    uint64_t file_size;   // Size of the file, used to trim the last block
+} stream_context_t;
+
+static int write_streamed_block(async_read_t *read, int index, void *context)
+{
+    stream_context_t *stream = context;
+    uint64_t offset = (uint64_t)(stream->first_index + index) * geometry.block_size;
+    size_t length = geometry.block_size;
+
+    if (offset + length > stream->file_size)
+    {
+        length = stream->file_size > offset ? stream->file_size - offset : 0;
+    }
+
+    // Write everything as removing null characters break binary files
+    fwrite(read->buffer, 1, length, stdout);
+    return 0;
+}
+
+// Function stream_file_blocks that prints a run of data blocks of a file to stdout in order. The blocks are read through the async read engine, ASYNC_READ_DEPTH at a time. first_index is the logical index of block_numbers[0] in the file. Returns 0 on success and -1 on failure.
+static int stream_file_blocks(const uint32_t *block_numbers, int count, uint32_t first_index, uint64_t file_size)
+{
+    static uint8_t *buffers = NULL;
+    async_read_t reads[ASYNC_READ_DEPTH];
+
+    if (buffers == NULL)
+    {
+        buffers = malloc((size_t)ASYNC_READ_DEPTH * geometry.block_size);
+        if (buffers == NULL)
+        {
+            return -1;
+        }
+    }
+
+    // The engine reads straight from the segment files, so pending writes must reach them first
+    flush_block_cache();
+
+    for (int start = 0; start < count; start += ASYNC_READ_DEPTH)
+    {
+        int batch = count - start < (int)ASYNC_READ_DEPTH ? count - start : (int)ASYNC_READ_DEPTH;
+
+        for (int i = 0; i < batch; i++)
+        {
+            uint32_t block_number = block_numbers[start + i];
+            segment_handle_t *segment = get_segment(SEGMENT_KIND_DATA, block_number / geometry.blocks_per_segment, 0);
+            if (segment == NULL || segment->bitmap == NULL || !bitmap_test(segment->bitmap, block_number % geometry.blocks_per_segment))
+            {
+                return -1; // Datablock not found
+            }
+
+            reads[i].fd = segment->fd;
+            reads[i].offset = segment_offset(segment, block_number % geometry.blocks_per_segment);
+            reads[i].buffer = buffers + (size_t)i * geometry.block_size;
+        }
+
+        stream_context_t stream = {first_index + start, file_size};
+        if (async_read_blocks(reads, batch, write_streamed_block, &stream) < 0)
+        {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+// Function to extract a file from the file system. The function takes a path as input and extracts the file from the file system. The function returns 0 on success and -1 on failure.
+int extract_file(const char *path, int verbose)
+{
+    char *path_segments[256];
+    int segment_count = split_path(path, path_segments, 256);
+
+    // Start with root inode (inode 0)
+    int current_inode_index = 0;
+    inode_t current_inode;
+    directoryblock_t dir_block;
+
+    // Traverse the path segments except the last one (which is the file)
+    for (int i = 0; i < segment_count; i++)
+    {
+        // Read the current inode
+        if (read_inode(current_inode_index, &current_inode) < 0)
+        {
+            fprintf(stderr, "Failed to read inode at index %d\n", current_inode_index);
+            return -1;
+        }
+
+        // Make sure it's a directory (except for the last segment which could be a file)
+        if (i < segment_count - 1 && current_inode.type != FILE_TYPE_DIRECTORY)
+        {
+            fprintf(stderr, "Path component %s is not a directory\n", path_segments[i]);
+            return -1;
+        }
+
+        // For directories, look through direct blocks for the directory block
+        int found_next_segment = 0;
+        for (int j = 0; j < MAX_DIRECT_BLOCKS; j++)
+        {
+            // TODO: Remove the ==0 check as all inode will be prefilled with MAX_UNIT_32
+            if (current_inode.direct_blocks[j] == MAX_UNIT_32 ||
+                current_inode.direct_blocks[j] == 0)
+            {
+                continue;
+            }
+
+            // Read directory block
+            if (read_directory_block(current_inode.direct_blocks[j], &dir_block) < 0)
+            {
+                fprintf(stderr, "Failed to read directory block %u\n", current_inode.direct_blocks[j]);
+                continue;
+            }
+
+            // Search for the next path segment in this directory block
+            for (int k = 0; k < MAX_DIRECTORY_ENTRIES; k++)
+            {
+                if (dir_block.entries[k].inuse == 1 &&
+                    strcmp(dir_block.entries[k].name, path_segments[i]) == 0)
+                {
+                    // Found the entry for the next path segment
+                    current_inode_index = dir_block.entries[k].inode_number;
+                    found_next_segment = 1;
+                    break;
+                }
+            }
+
+            if (found_next_segment)
+            {
+                break;
+            }
+        }
+
+        if (!found_next_segment)
+        {
+            if (verbose)
+            {
+
+                fprintf(stderr, "Path component %s not found\n", path_segments[i]);
+            }
+            return -1;
+        }
+    }
+
+    inode_t file_inode;
+
+    if (read_inode(current_inode_index, &file_inode) < 0)
+    {
+        fprintf(stderr, "Failed to read file inode at index %d\n", current_inode_index);
+        return -1;
+    }
+
+    // Data is only read when it is going to be printed
+    if (!verbose)
+    {
+        return 0;
+    }
+
+    // Inline data came with the inode
+    if (file_inode.flags & INODE_INLINE)
+    {
+        fwrite(file_inode.inline_data, 1, file_inode.size, stdout);
+        return 0;
+    }
+
+    // Block pointers are collected up front, an extent tree is mapped as the readahead window reaches it
+    int total = (file_inode.size + geometry.block_size - 1) / geometry.block_size;
+    block_list_t blocks = {NULL, 0, 0};
+    if (!(file_inode.flags & INODE_EXTENTS) && collect_file_blocks(&file_inode, &blocks) < 0)
+    {
+        free(blocks.blocks);
+        return -1;
+    }
+
+    // Stream the data one batch at a time, keeping readahead hints ahead of the batch being read
+    readahead_t readahead = {0, READAHEAD_MIN_BLOCKS, 0};
+    for (int start = 0; start < total; start += ASYNC_READ_DEPTH)
+    {
+        int batch = total - start < (int)ASYNC_READ_DEPTH ? total - start : (int)ASYNC_READ_DEPTH;
+        struct timespec begin, end;
+
+        int mapped = start + batch + readahead.window < total ? start + batch + readahead.window : total;
+        if ((file_inode.flags & INODE_EXTENTS) && map_file_range(&file_inode, &blocks, mapped) < 0)
+        {
+            free(blocks.blocks);
+            return -1;
+        }
+        if (blocks.count < start + batch)
+        {
+            fprintf(stderr, "File is missing datablocks\n");
+            free(blocks.blocks);
+            return -1;
+        }
+        readahead_advance(&readahead, &blocks, start + batch);
+
+        clock_gettime(CLOCK_MONOTONIC, &begin);
+        if (stream_file_blocks(blocks.blocks + start, batch, start, file_inode.size) < 0)
+        {
+            fprintf(stderr, "Failed to read datablock\n");
+            free(blocks.blocks);
+            return -1;
+        }
+        clock_gettime(CLOCK_MONOTONIC, &end);
+
+        double seconds = (end.tv_sec - begin.tv_sec) + (end.tv_nsec - begin.tv_nsec) / 1e9;
+        readahead_update(&readahead, batch, seconds);
+        STAT_ADD(read_bytes, (uint64_t)batch * geometry.block_size);
+        STAT_ADD(read_seconds, seconds);
+    }
+
+    free(blocks.blocks);
+    return 0;
+}
+
+int free_inode(int inode_number);
+int remove_inode_and_blocks(int inode_number);
+
+// Function to add file to the filesystem
+int add_file(const char *fs_path, const char *local_file)
+{
+
+    if (extract_file(fs_path, 0) == 0)
+    {
+        fprintf(stderr, "Failed ! Filename already exists.\n");
+        // printf("Failed ! Filename already exists.\n");
+        return -1;
+    }
+
+    // In the add_file function:
+    char *path_segments[256];
+    int segment_count = split_path(fs_path, path_segments, 256);
+
+    // // Print the segments
+    // printf("Path Segments:\n");
+    // for (int i = 0; i < segment_count; i++)
+    // {
+    //     printf("%s\n", path_segments[i]);
+    // }
+
+    // printf("Size of file %d", sizeof(local_file));
+
+    // The file is stored once its parent directory is known, check it can be read before creating any directories
+    if (access(local_file, R_OK) != 0)
+    {
+        perror("Failed to open file");
+        return -1;
+    }
+
+    directoryblock_t directoryblock;
+
+    for (int i = 0; i < MAX_DIRECTORY_ENTRIES; i++)
+    {
+        directoryblock.entries[i].inode_number = MAX_UNIT_32;
+        directoryblock.entries[i].type = MAX_UNIT_32;
+        directoryblock.entries[i].inuse = 0;
+        strncpy(directoryblock.entries[i].name, "", sizeof(directoryblock.entries[i].name) - 1);
+        directoryblock.entries[i].name[sizeof(directoryblock.entries[i].name) - 1] = '\0'; // Ensure null termination
+    }
+
+    // Create directory for each segment if the directory is already not present and link them together with inodes in between them.
+    //     If the fs_path is /dir1/dir2/sample.txt
+    // Then the root inode at inode_index 0 will have direct_blocks mapping to directory_block at index 0.
+    // Now inode for dir1 is created and then a new directory entry for under the root_directory block is created storing name as dir1 and the inode_number for recently created inode of dir1.
+    // Similarly, do the same for dir2 and save its inode_number in dir1 directory block that is accessed in inode direct_blocks[0].
+    // Now create a inode of type file and point it to the file created and then save the inode number and file name in the directory block of dir2.
+    // So now the chain would look something like this root inode -> root directory block -> dir1 inode -> dir1 directory block -> dir2 inode -> dir2 directory block -> sample.txt inode -> sample.txt directory block.
+    // For accessing each directory block, the inode of each has direct_blocks array where the first element of that direct_blocks array has index in the directory/datablock segment.
+
+    // Start with root inode (assumed to be at index 0)
+    int current_inode_index = 0;
+    inode_t current_inode;
+    directoryblock_t current_dir_block;
+
+    // Segments new inodes and blocks are placed near, those of the directory being walked
+    uint32_t inode_goal = ALLOC_GOAL_NONE;
+    uint32_t data_goal = ALLOC_GOAL_NONE;
+
+    // For each directory segment (except the last one which is the file)
+    for (int i = 0; i < segment_count - 1; i++)
+    {
+        // Read the current inode
+        if (read_inode(current_inode_index, &current_inode) < 0)
+        {
+            fprintf(stderr, "Failed to read inode at index %d\n", current_inode_index);
+            return -1;
+        }
+
+        // Find the directory block for this inode
+        int dir_block_index = -1;
+        for (int j = 0; j < MAX_DIRECT_BLOCKS; j++)
+        {
+            if (current_inode.direct_blocks[j] != MAX_UNIT_32 &&
+                current_inode.direct_blocks[j] != 0)
+            {
+                dir_block_index = current_inode.direct_blocks[j];
+                break;
+            }
+        }
+
+        if (dir_block_index < 0)
+        {
+            // This inode doesn't point to any directory block yet, create one
+            for (int k = 0; k < MAX_DIRECTORY_ENTRIES; k++)
+            {
+                directoryblock.entries[k].inuse = 0;
+            }
+            dir_block_index = create_directoryblock(&directoryblock, data_goal);
+            if (dir_block_index < 0)
+            {
+                fprintf(stderr, "Failed to create directory block\n");
+                return -1;
+            }
+
+            // Update the inode to point to this directory block
+            for (int j = 0; j < MAX_DIRECT_BLOCKS; j++)
+            {
+                if (current_inode.direct_blocks[j] == 0 ||
+                    current_inode.direct_blocks[j] == MAX_UNIT_32)
+                {
+                    current_inode.direct_blocks[j] = dir_block_index;
+
+                    // Write the updated inode
+                    if (write_inode(current_inode_index, &current_inode) < 0)
+                    {
+                        return -1;
+                    }
+                    break;
+                }
+            }
+        }
+
+        inode_goal = inode_segment(current_inode_index);
+        data_goal = dir_block_index / geometry.blocks_per_segment;
+
+        // Read the directory block
+        if (read_directory_block(dir_block_index, &current_dir_block) < 0)
+        {
+            fprintf(stderr, "Failed to read directory block at index %d\n", dir_block_index);
+            return -1;
+        }
+
+        // Look for the directory entry for the next path segment
+        directory_entry_t *found_entry = NULL;
+        int entry_index = find_entry_in_directory(&current_dir_block, path_segments[i], &found_entry);
+
+        if (entry_index < 0)
+        {
+            // Directory doesn't exist, create it
+            inode_t new_dir_inode;
+            memset(&new_dir_inode, 0, sizeof(inode_t));
+            new_dir_inode.type = FILE_TYPE_DIRECTORY;
+            new_dir_inode.single_indirect = MAX_UNIT_32;
+            new_dir_inode.double_indirect = MAX_UNIT_32;
+            new_dir_inode.triple_indirect = MAX_UNIT_32;
+            for (int j = 0; j < MAX_DIRECT_BLOCKS; j++)
+            {
+                new_dir_inode.direct_blocks[j] = MAX_UNIT_32;
+            }
+
+            // A top level directory starts a group of its own, a nested one stays near its parent
+            if (current_inode_index == 0)
+            {
+                inode_goal = spread_goal(SEGMENT_KIND_INODE);
+                data_goal = spread_goal(SEGMENT_KIND_DATA);
+            }
+
+            // Create the new inode for the directory
+            int new_inode_index = create_inode(&new_dir_inode, inode_goal);
+            if (new_inode_index < 0)
+            {
+                fprintf(stderr, "Failed to create inode for directory %s\n", path_segments[i]);
+                return -1;
+            }
+
+            // Add directory entry to the current directory block
+            directory_entry_t new_entry;
+            new_entry.inode_number = new_inode_index;
+            new_entry.type = FILE_TYPE_DIRECTORY;
+            new_entry.inuse = 1;
+            strncpy(new_entry.name, path_segments[i], sizeof(new_entry.name) - 1);
+            new_entry.name[sizeof(new_entry.name) - 1] = '\0';
+
+            if (add_directoryentry_to_directoryblock(dir_block_index, &new_entry) < 0)
+            {
+                fprintf(stderr, "Failed to add directory entry for %s\n", path_segments[i]);
+                free_inode(new_inode_index);
+                return -1;
+            }
+
+            current_inode_index = new_inode_index;
+        }
+        else
+        {
+            // Directory exists, continue with its inode
+            current_inode_index = found_entry->inode_number;
+        }
+    }
+
+    // Now add the file to the last directory
+    if (read_inode(current_inode_index, &current_inode) < 0)
+    {
+        fprintf(stderr, "Failed to read final directory inode\n");
+        return -1;
+    }
+
+    // Find the directory block for this inode
+    int dir_block_index = -1;
+    for (int j = 0; j < MAX_DIRECT_BLOCKS; j++)
+    {
+        if (current_inode.direct_blocks[j] != MAX_UNIT_32 &&
+            current_inode.direct_blocks[j] != 0)
+        {
+            dir_block_index = current_inode.direct_blocks[j];
+            break;
+        }
+    }
+
+    if (dir_block_index < 0)
     {
         // Create a new directory block
         for (int k = 0; k < MAX_DIRECTORY_ENTRIES; k++)
         {
-            directoryblock.entries[k].inuse = 0;
+            directoryblock.entries[k].inuse = 0;
+        }
+        dir_block_index = create_directoryblock(&directoryblock, data_goal);
+        if (dir_block_index < 0)
+        {
+            fprintf(stderr, "Failed to create directory block for file\n");
+            return -1;
+        }
+
+        // Update the inode to point to this directory block
+        for (int j = 0; j < MAX_DIRECT_BLOCKS; j++)
+        {
+            if (current_inode.direct_blocks[j] == 0 ||
+                current_inode.direct_blocks[j] == MAX_UNIT_32)
+            {
+                current_inode.direct_blocks[j] = dir_block_index;
+
+                // Write the updated inode
+                if (write_inode(current_inode_index, &current_inode) < 0)
+                {
+                    return -1;
+                }
+                break;
+            }
+        }
+    }
+
+    // Store the file near the directory it is added to
+    int inode_index = create_inode_for_file(local_file, inode_segment(current_inode_index), dir_block_index / geometry.blocks_per_segment);
+    if (inode_index < 0)
+    {
+        fprintf(stderr, "Failed to create inode for file\n");
+        return -1;
+    }
+
+    // Add file entry to final directory
+    directory_entry_t file_entry;
+    file_entry.inode_number = inode_index;
+    file_entry.type = FILE_TYPE_REGULAR;
+    file_entry.inuse = 1;
+    strncpy(file_entry.name, path_segments[segment_count - 1], sizeof(file_entry.name) - 1);
+    file_entry.name[sizeof(file_entry.name) - 1] = '\0';
+
+    if (add_directoryentry_to_directoryblock(dir_block_index, &file_entry) < 0)
+    {
+        // Nothing points at the file yet, hand its inode and blocks back
+        fprintf(stderr, "Failed to add file entry to directory\n");
+        remove_inode_and_blocks(inode_index);
+        return -1;
+    }
+
+    // // Free allocated memory for path segments
+    // for (int i = 0; i < segment_count; i++)
+    // {
+    //     free(path_segments[i]);
+    // }
+
+    return 0;
+}
+
+// Function to debug the path. This function takes prints the bitmap of all the segments and inodes files. Both INODE_SEGMENT_NAME_PATTERN and DATA_SEGMENT_NAME_PATTERN inital bitmap are printed here.
+int debug_path(const char *path)
+{
+    // In the add_file function:
+    char *path_segments[10];
+    int segment_count = split_path(path, path_segments, 10);
+
+    // Print the segments
+    printf("Path Segments:\n");
+    for (int i = 0; i < segment_count; i++)
+    {
+        printf("%s\n", path_segments[i]);
+    }
+
+    // Print the bitmap of all the segments and inodes files
+    int segment_num = 0;
+    char filename[32];
+    segment_handle_t *segment = NULL;
+    uint8_t *bitmap = NULL;
+
+    // Check inode segments
+    while (1)
+    {
+        // Generate segment filename
+        sprintf(filename, INODE_SEGMENT_NAME_PATTERN, segment_num);
+
+        // Try to open the file
+        segment = get_segment(SEGMENT_KIND_INODE, segment_num, 0);
+        if (segment == NULL)
+        {
+            // No more inode segments
+            break;
+        }
+
+        // Read the bitmap from the file
+        bitmap = segment->bitmap;
+        if (bitmap == NULL)
+        {
+            perror("Failed to read bitmap");
+            return -2;
+        }
+
+        printf("Bitmap of %s: ", filename);
+        for (int j = 0; j < (int)geometry.blocks_per_segment; j++)
+        {
+            printf("%u ", bitmap_test(bitmap, j));
+        }
+        printf("\n");
+
+        // From the bitmap, list all the inode details that are in use, numbered from the start of the segment
+        for (int i = 0; i < (int)(geometry.blocks_per_segment * geometry.inodes_per_block); i++)
+        {
+            if (bitmap_test(bitmap, i / geometry.inodes_per_block))
+            {
+                inode_t inode;
+                int result = read_inode((segment_num * geometry.blocks_per_segment) * geometry.inodes_per_block + i, &inode);
+                if (result == -2 && geometry.inodes_per_block > 1)
+                {
+                    continue; // Free record of a compact inode block
+                }
+                if (result < 0)
+                {
+                    fprintf(stderr, "Failed to read inode\n");
+                    return -2;
+                }
+                printf("Inode %d: Type: %u, Size: %lu, Single Indirect %d, Double Indirect %d\n", i, inode.type, inode.size, inode.single_indirect, inode.double_indirect);
+                // printf("Direct blocks: ");
+                // for (int k = 0; k < MAX_DIRECT_BLOCKS; k++)
+                // {
+                //     printf("%u ", inode.direct_blocks[k]);
+                // }
+                // printf("\n");
+            }
+        }
+
+        printf("\n");
+
+        segment_num++;
+    }
+
+    // Reset segment_num for data segments
+    segment_num = 0;
+
+    // Check data segments
+    while (1)
+    {
+        // Generate segment filename
+        sprintf(filename, DATA_SEGMENT_NAME_PATTERN, segment_num);
+
+        // Try to open the file
+        segment = get_segment(SEGMENT_KIND_DATA, segment_num, 0);
+        if (segment == NULL)
+        {
+            // No more data segments
+            break;
+        }
+
+        // Read the bitmap from the file
+        bitmap = segment->bitmap;
+        if (bitmap == NULL)
+        {
+            perror("Failed to read bitmap");
+            return -2;
+        }
+
+        printf("Bitmap of %s: ", filename);
+        for (int j = 0; j < (int)geometry.blocks_per_segment; j++)
+        {
+            printf("%u ", bitmap_test(bitmap, j));
+        }
+        printf("\n");
+
+        // From the bitmap, list all the datablock details that are in use
+        for (int i = 0; i < (int)geometry.blocks_per_segment; i++)
+        {
+            if (bitmap_test(bitmap, i))
+            {
+                // First read it as a datablock to check the content
+                datablock_t datablock;
+                int result = read_datablock((segment_num * geometry.blocks_per_segment) + i, &datablock);
+
+                if (result < 0)
+                {
+                    fprintf(stderr, "Failed to read datablock %d\n", i);
+                    return -2;
+                }
+
+                // Try to read it as a directory block to check if it has valid entries
+                directoryblock_t directory_block;
+                if (read_directory_block((segment_num * geometry.blocks_per_segment) + i, &directory_block) == 0)
+                {
+                    if (directory_block.entries[0].inuse == 1)
+                    {
+                        printf("Datablock %d: Directory Block, First entry: %s (inode: %u)\n",
+                               i, directory_block.entries[0].name, directory_block.entries[0].inode_number);
+                        continue;
+                    }
+                }
+
+                // Otherwise print as regular datablock
+                printf("Datablock %d: Regular Block, Size: %u \n", i, geometry.block_size);
+            }
+        }
+        printf("\n");
+
+        segment_num++;
+    }
+
+    return 0;
+}
+
+// Forward declaration
+static void list_directory_recursive(int inode_number, int depth);
+
+// Print entries in a directory block
+static void print_directory_entries(directoryblock_t *dir_block, int depth)
+{
+    for (int i = 0; i < MAX_DIRECTORY_ENTRIES; i++)
+    {
+        if (dir_block->entries[i].inuse == 1)
+        {
+            // Print indentation
+            for (int j = 0; j < depth; j++)
+            {
+                printf("│   ");
+            }
+
+            printf("├── %s [Inode: %u, %s]\n",
+                   dir_block->entries[i].name,
+                   dir_block->entries[i].inode_number,
+                   dir_block->entries[i].type == FILE_TYPE_DIRECTORY ? "Directory" : "File");
+
+            // Recursively list subdirectories
+            if (dir_block->entries[i].type == FILE_TYPE_DIRECTORY)
+            {
+                list_directory_recursive(dir_block->entries[i].inode_number, depth + 1);
+            }
+        }
+    }
+}
+
+// Recursively list contents of a directory starting from the given inode
+static void list_directory_recursive(int inode_number, int depth)
+{
+    inode_t inode;
+    int result = read_inode(inode_number, &inode);
+
+    if (result < 0)
+    {
+        fprintf(stderr, "Failed to read inode %d\n", inode_number);
+        return;
+    }
+
+    if (inode.type != FILE_TYPE_DIRECTORY)
+    {
+        return; // Not a directory
+    }
+
+    // Process each direct block that could be a directory block
+    for (int i = 0; i < MAX_DIRECT_BLOCKS; i++)
+    {
+        if (inode.direct_blocks[i] != MAX_UNIT_32 && inode.direct_blocks[i] != 0)
+        {
+            directoryblock_t dir_block;
+            if (read_directory_block(inode.direct_blocks[i], &dir_block) == 0)
+            {
+                print_directory_entries(&dir_block, depth);
+            }
+        }
+    }
+}
+
+// List directory starting from the root inode (inode 0)
+int list_directory(int unused)
+{
+    printf("Root [Inode: 0, Directory]\n");
+    list_directory_recursive(0, 1);
+    return 0;
+}
+
+// Function to initialize the file system that creates the first inode and first datasegments of the file system. The first inode is the root inode and the first datasegment is the root datasegment. The root inode is a directory and the root datasegment is a directory.
+int init_file_system()
+{
+    inode_t inode;
+    directoryblock_t directoryblock;
+
+    // Try to open the first inode segment and first data segment, if they exist the file system is already initialized
+    segment_handle_t *inode_segment = get_segment(SEGMENT_KIND_INODE, 0, 0);
+    segment_handle_t *data_segment = get_segment(SEGMENT_KIND_DATA, 0, 0);
+
+    // Maybe we can only initialize the directory block upon need rather then prefilling it
+    if (data_segment == NULL && inode_segment == NULL)
+    {
+        for (int i = 0; i < MAX_DIRECTORY_ENTRIES; i++)
+        {
+            if (i == 0)
+            {
+
+                directoryblock.entries[0].inode_number = MAX_UNIT_32;
+                directoryblock.entries[0].type = FILE_TYPE_DIRECTORY;
+                directoryblock.entries[0].inuse = 1;
+                strncpy(directoryblock.entries[0].name, "root", sizeof(directoryblock.entries[0].name) - 1);
+                directoryblock.entries[0].name[sizeof(directoryblock.entries[0].name) - 1] = '\0'; // Ensure null termination
+            }
+            else
+            {
+                directoryblock.entries[i].inode_number = MAX_UNIT_32;
+                directoryblock.entries[i].type = FILE_TYPE_REGULAR;
+                directoryblock.entries[i].inuse = 0;
+                strncpy(directoryblock.entries[i].name, "", sizeof(directoryblock.entries[i].name) - 1);
+                directoryblock.entries[i].name[sizeof(directoryblock.entries[i].name) - 1] = '\0'; // Ensure null termination
+            }
+        }
+
+        int root_directoryblock_index = create_directoryblock(&directoryblock, ALLOC_GOAL_NONE);
+
+        // printf("Directory Block Size: %lu\n", sizeof(directoryblock_t));
+        // printf("Directory Entry Size: %lu\n", sizeof(directory_entry_t));
+        // printf("Data Block Size: %lu\n", sizeof(datablock_t));
+        // printf("MAX_DIRECTORY_ENTRIES: %lu\n", MAX_DIRECTORY_ENTRIES);
+        // printf("INode Size: %lu\n", sizeof(inode_t));
+
+        // fill MAX_DIRECT_BLOCKS with 0
+        for (int i = 0; i < MAX_DIRECT_BLOCKS; i++)
+        {
+            inode.direct_blocks[i] = 0; // Initialize direct blocks
+        }
+
+        // inode.direct_blocks[0] = root_directoryblock_index;
+        inode.type = FILE_TYPE_DIRECTORY; // Directory type
+        inode.size = 0;                   // Size is initially 0
+        inode.single_indirect = MAX_UNIT_32;
+        inode.double_indirect = MAX_UNIT_32;
+        inode.triple_indirect = MAX_UNIT_32;
+        inode.flags = 0;
+
+        int root_inode_index = create_inode(&inode, ALLOC_GOAL_NONE);
+        if (root_inode_index < 0)
+        {
+            fprintf(stderr, "Failed to create root inode\n");
+            return -1;
+        }
+
+        return 0;
+    }
+    else
+    {
+        return 0; // File system already initialized
+    }
+}
+
+// Function convert_to_image that converts the legacy volume in the current directory, one inodeseg%d/dataseg%d file per segment, into a single image file. Every segment file is copied into its region of a temporary image, which is synced and renamed to IMAGE_FILE_NAME before the segment files and their superblock file are removed. The function returns 0 on success and -1 on failure.
+int convert_to_image()
+{
+    if (access(IMAGE_FILE_NAME, F_OK) == 0)
+    {
+        fprintf(stderr, "%s already exists\n", IMAGE_FILE_NAME);
+        return -1;
+    }
+
+    // Keep the geometry of the volume, volumes without a superblock file use the defaults
+    int superblock_fd = open(SUPERBLOCK_FILE_NAME, O_RDONLY);
+    if (superblock_fd >= 0)
+    {
+        int result = load_superblock(superblock_fd);
+        close(superblock_fd);
+        if (result < 0)
+        {
+            return -1;
+        }
+    }
+    else
+    {
+        memset(&superblock, 0, sizeof(superblock));
+        memcpy(superblock.magic, SUPERBLOCK_MAGIC, sizeof(superblock.magic));
+        superblock.block_size = geometry.block_size;
+        superblock.segment_size = geometry.segment_size;
+    }
+
+    // The image gets a fresh reserved area, its allocation summary is rebuilt when it is first opened
+    superblock.reserved_size = IMAGE_RESERVED_SIZE;
+    superblock.flags &= ~SUPERBLOCK_ALLOC_SUMMARY;
+    superblock.first_free[SEGMENT_KIND_INODE] = 0;
+    superblock.first_free[SEGMENT_KIND_DATA] = 0;
+
+    uint8_t *buffer = malloc(geometry.segment_size);
+    int fd = open(IMAGE_FILE_NAME ".tmp", O_RDWR | O_CREAT | O_TRUNC, 0666);
+    if (buffer == NULL || fd < 0)
+    {
+        perror("Failed to create image");
+        free(buffer);
+        return -1;
+    }
+
+    superblock_t header = superblock;
+    header.segment_count[SEGMENT_KIND_INODE] = 0;
+    header.segment_count[SEGMENT_KIND_DATA] = 0;
+
+    char filename[32];
+    for (int kind = 0; kind < 2; kind++)
+    {
+        for (int segment_num = 0;; segment_num++)
+        {
+            sprintf(filename, kind == SEGMENT_KIND_INODE ? INODE_SEGMENT_NAME_PATTERN : DATA_SEGMENT_NAME_PATTERN, segment_num);
+            int segment_fd = open(filename, O_RDONLY);
+            if (segment_fd < 0)
+            {
+                break;
+            }
+
+            ssize_t size = segment_pread(segment_fd, buffer, geometry.segment_size, 0);
+            close(segment_fd);
+            if (size < 0 || segment_pwrite(fd, buffer, size, image_segment_base(kind, segment_num)) != size)
+            {
+                fprintf(stderr, "Failed to copy %s\n", filename);
+                close(fd);
+                unlink(IMAGE_FILE_NAME ".tmp");
+                free(buffer);
+                return -1;
+            }
+            header.segment_count[kind]++;
+        }
+    }
+    free(buffer);
+
+    if (header.segment_count[SEGMENT_KIND_INODE] == 0)
+    {
+        fprintf(stderr, "No segment files to convert\n");
+        close(fd);
+        unlink(IMAGE_FILE_NAME ".tmp");
+        return -1;
+    }
+
+    if (segment_pwrite(fd, &header, sizeof(header), 0) != sizeof(header) || fsync(fd) != 0 || rename(IMAGE_FILE_NAME ".tmp", IMAGE_FILE_NAME) != 0)
+    {
+        perror("Failed to write image");
+        close(fd);
+        unlink(IMAGE_FILE_NAME ".tmp");
+        return -1;
+    }
+    close(fd);
+
+    for (int kind = 0; kind < 2; kind++)
+    {
+        for (uint32_t segment_num = 0; segment_num < header.segment_count[kind]; segment_num++)
+        {
+            sprintf(filename, kind == SEGMENT_KIND_INODE ? INODE_SEGMENT_NAME_PATTERN : DATA_SEGMENT_NAME_PATTERN, segment_num);
+            unlink(filename);
+        }
+    }
+    unlink(SUPERBLOCK_FILE_NAME);
+
+    printf("Converted %u inode segments and %u data segments into %s\n", header.segment_count[SEGMENT_KIND_INODE], header.segment_count[SEGMENT_KIND_DATA], IMAGE_FILE_NAME);
+    return 0;
+}
+
+// Function remove_file that takes a path as input and removes the file from the file system. The function returns 0 on success and -1 on failure. The function navigate through the paths and recursively deletes the last segment. If its a file, just delete the file and if its a folder delete the folder and also delete everything in the folder recursively. By deleting, if its a inode then mark it as free in the bitmap and if its a datablock then mark it as free in the bitmap. The function also updates the parent directory to remove the entry for the deleted file or folder. For the directory entry, it should mark the inuse as 0.
+int remove_inode_and_blocks(int inode_number);
+
+// Helper function to mark inode as free in bitmap. A compact inode is cleared in its inode block, which is freed once all its records are, and otherwise becomes the block create_inode fills next.
+int free_inode(int inode_number)
+{
+    if (geometry.inodes_per_block == 1)
+    {
+        return free_block(SEGMENT_KIND_INODE, inode_number);
+    }
+
+    uint32_t block_number = inode_number / geometry.inodes_per_block;
+    compact_inode_t records[geometry.inodes_per_block];
+    if (read_block(SEGMENT_KIND_INODE, block_number, records, sizeof(records)) < 0)
+    {
+        return -1;
+    }
+    memset(&records[inode_number % geometry.inodes_per_block], 0, sizeof(compact_inode_t));
+    for (uint32_t i = 0; i < geometry.inodes_per_block; i++)
+    {
+        if (records[i].type != 0)
+        {
+            superblock.next_fit[SEGMENT_KIND_INODE] = block_number + 1;
+            summary.dirty = 1;
+            return write_block(SEGMENT_KIND_INODE, block_number, records, sizeof(records));
         }
-        dir_block_index = create_directoryblock(&directoryblock);
-        if (dir_block_index < 0)
+    }
+    return free_block(SEGMENT_KIND_INODE, block_number);
+}
+
+// Helper function to mark datablock as free in bitmap
+int free_datablock(int datablock_number)
+{
+    return free_block(SEGMENT_KIND_DATA, datablock_number);
+}
+
+// Function free_indirect_tree that frees indirect block block_number of inode, level levels above the data, and the indirect blocks below it, but not the data blocks
+static void free_indirect_tree(const inode_t *inode, uint32_t block_number, int level)
+{
+    if (level > 1)
+    {
+        uint32_t pointers[POINTERS_PER_BLOCK];
+        int count = read_pointers(inode, block_number, pointers);
+        for (int i = 0; i < count; i++)
         {
-            fprintf(stderr, "Failed to create directory block for file\n");
-            return -1;
+            free_indirect_tree(inode, pointers[i], level - 1);
         }
+    }
+    free_datablock(block_number);
+}
 
-        // Update the inode to point to this directory block
-        for (int j = 0; j < MAX_DIRECT_BLOCKS; j++)
+// Function free_file_blocks that frees the data blocks of a regular file, found through the inode the same way extract_file finds them, and then the indirect blocks or extent-tree blocks above them
+static void free_file_blocks(inode_t *inode)
+{
+    block_list_t list = {NULL, 0, 0};
+    block_list_t nodes = {NULL, 0, 0};
+    int result = collect_file_blocks(inode, &list);
+    if (result == 0 && (inode->flags & INODE_EXTENTS))
+    {
+        result = collect_extent_nodes(inode->extents, inode->extent_header.count, inode->extent_header.depth, &nodes);
+    }
+    if (result == 0)
+    {
+        for (int i = 0; i < list.count; i++)
         {
-            if (current_inode.direct_blocks[j] == 0 ||
-                current_inode.direct_blocks[j] == MAX_UNIT_32)
+            free_datablock(list.blocks[i]);
+        }
+        for (int i = 0; i < nodes.count; i++)
+        {
+            free_datablock(nodes.blocks[i]);
+        }
+    }
+    free(list.blocks);
+    free(nodes.blocks);
+
+    // Then the indirect blocks, which point to the blocks below them
+    if (inode->single_indirect != 0 && inode->single_indirect != MAX_UNIT_32)
+    {
+        free_indirect_tree(inode, inode->single_indirect, 1);
+    }
+    if (inode->double_indirect != 0 && inode->double_indirect != MAX_UNIT_32)
+    {
+        free_indirect_tree(inode, inode->double_indirect, 2);
+    }
+    if (inode->triple_indirect != 0 && inode->triple_indirect != MAX_UNIT_32)
+    {
+        free_indirect_tree(inode, inode->triple_indirect, 3);
+    }
+}
+
+// Recursive function to remove an inode and all associated blocks
+int remove_inode_and_blocks(int inode_number)
+{
+    inode_t inode;
+    int result = read_inode(inode_number, &inode);
+    if (result < 0)
+    {
+        return result;
+    }
+
+    // If it's a directory, recursively remove all entries
+    if (inode.type == FILE_TYPE_DIRECTORY)
+    {
+        for (int i = 0; i < MAX_DIRECT_BLOCKS; i++)
+        {
+            if (inode.direct_blocks[i] == MAX_UNIT_32 || inode.direct_blocks[i] == 0)
             {
-                current_inode.direct_blocks[j] = dir_block_index;
+                continue;
+            }
 
-                // Write the updated inode
-                FILE *inode_file = NULL;
-                char inode_filename[32];
-                int segment_num = current_inode_index / 255;
-                int inode_idx = current_inode_index % 255;
-
-                sprintf(inode_filename, INODE_SEGMENT_NAME_PATTERN, segment_num);
-                inode_file = fopen(inode_filename, "r+b");
-                if (inode_file == NULL)
+            directoryblock_t dir_block;
+            if (read_directory_block(inode.direct_blocks[i], &dir_block) == 0)
+            {
+                // Remove all entries in this directory block
+                for (int j = 0; j < MAX_DIRECTORY_ENTRIES; j++)
                 {
-                    return -1;
+                    if (dir_block.entries[j].inuse == 1)
+                    {
+                        remove_inode_and_blocks(dir_block.entries[j].inode_number);
+                    }
                 }
-
-                fseek(inode_file, (inode_idx + 1) * INODE_SIZE, SEEK_SET);
-                fwrite(&current_inode, sizeof(inode_t), 1, inode_file);
-                fclose(inode_file);
-                break;
             }
+
+            // Free the directory block
+            free_datablock(inode.direct_blocks[i]);
         }
     }
-
-    // Add file entry to final directory
-    directory_entry_t file_entry;
-    file_entry.inode_number = inode_index;
-    file_entry.type = FILE_TYPE_REGULAR;
-    file_entry.inuse = 1;
-    strncpy(file_entry.name, path_segments[segment_count - 1], sizeof(file_entry.name) - 1);
-    file_entry.name[sizeof(file_entry.name) - 1] = '\0';
-
-    if (add_directoryentry_to_directoryblock(dir_block_index, &file_entry) < 0)
+    else
     {
-        fprintf(stderr, "Failed to add file entry to directory\n");
-        return -1;
+        // Regular file - free all datablocks and the indirect blocks above them
+        free_file_blocks(&inode);
     }
 
-    // // Free allocated memory for path segments
-    // for (int i = 0; i < segment_count; i++)
-    // {
-    //     free(path_segments[i]);
-    // }
-
-    return 0;
+    // Finally, free the inode itself
+    return free_inode(inode_number);
 }
 
-// Function to debug the path. This function takes prints the bitmap of all the segments and inodes files. Both INODE_SEGMENT_NAME_PATTERN and DATA_SEGMENT_NAME_PATTERN inital bitmap are printed here.
-int debug_path(const char *path)
+int remove_file(const char *path)
 {
-    // In the add_file function:
     char *path_segments[10];
     int segment_count = split_path(path, path_segments, 10);
-
-    // Print the segments
-    printf("Path Segments:\n");
-    for (int i = 0; i < segment_count; i++)
+    if (segment_count <= 0)
     {
-        printf("%s\n", path_segments[i]);
+        return -1; // Invalid path
     }
 
-    // Print the bitmap of all the segments and inodes files
-    int segment_num = 0;
-    char filename[32];
-    FILE *file = NULL;
-    uint8_t bitmap[BITMAP_BYTES];
+    // Start with root inode
+    int current_inode_index = 0;
+    int parent_inode_index = 0;
+    int parent_dir_block_index = -1;
+    int entry_index_in_parent = -1;
 
-    // Check inode segments
-    while (1)
-    {
-        // Generate segment filename
-        sprintf(filename, INODE_SEGMENT_NAME_PATTERN, segment_num);
+    inode_t current_inode;
+    directoryblock_t dir_block;
 
-        // Try to open the file
-        file = fopen(filename, "rb");
-        if (file == NULL)
+    // Navigate to the parent of the target file/directory
+    for (int i = 0; i < segment_count - 1; i++)
+    {
+        if (read_inode(current_inode_index, &current_inode) < 0)
         {
-            // No more inode segments
-            break;
+            fprintf(stderr, "Failed to read inode at index %d\n", current_inode_index);
+            return -1;
         }
 
-        // Read the bitmap from the file
-        if (fread(bitmap, sizeof(bitmap), 1, file) != 1)
+        if (current_inode.type != FILE_TYPE_DIRECTORY)
         {
-            perror("Failed to read bitmap");
-            fclose(file);
-            return -2;
+            fprintf(stderr, "Path component %s is not a directory\n", path_segments[i]);
+            return -1;
         }
 
-        printf("Bitmap of %s: ", filename);
-        for (int j = 0; j < BITMAP_BYTES; j++)
+        int found_next_segment = 0;
+        for (int j = 0; j < MAX_DIRECT_BLOCKS; j++)
         {
-            printf("%u ", bitmap[j]);
-        }
-        printf("\n");
+            if (current_inode.direct_blocks[j] == MAX_UNIT_32 ||
+                current_inode.direct_blocks[j] == 0)
+            {
+                continue;
+            }
 
-        // From the bitmap, list all the inode details that are in use
-        for (int i = 0; i < BITMAP_BYTES; i++)
-        {
-            if (bitmap[i] == 1)
+            if (read_directory_block(current_inode.direct_blocks[j], &dir_block) < 0)
             {
-                inode_t inode;
-                int result = read_inode(i, &inode);
-                if (result < 0)
+                continue;
+            }
+
+            for (int k = 0; k < MAX_DIRECTORY_ENTRIES; k++)
+            {
+                if (dir_block.entries[k].inuse == 1 &&
+                    strcmp(dir_block.entries[k].name, path_segments[i]) == 0)
                 {
-                    fprintf(stderr, "Failed to read inode\n");
-                    fclose(file);
-                    return -2;
+                    parent_inode_index = current_inode_index;
+                    current_inode_index = dir_block.entries[k].inode_number;
+                    found_next_segment = 1;
+                    break;
                 }
-                printf("Inode %d: Type: %u, Size: %lu, Single Indirect %d, Double Indirect %d\n", i, inode.type, inode.size, inode.single_indirect, inode.double_indirect);
-                // printf("Direct blocks: ");
-                // for (int k = 0; k < MAX_DIRECT_BLOCKS; k++)
-                // {
-                //     printf("%u ", inode.direct_blocks[k]);
-                // }
-                // printf("\n");
             }
-        }
 
-        printf("\n");
+            if (found_next_segment)
+            {
+                break;
+            }
+        }
 
-        fclose(file);
-        segment_num++;
+        if (!found_next_segment)
+        {
+            fprintf(stderr, "Path component %s not found\n", path_segments[i]);
+            return -1;
+        }
     }
 
-    // Reset segment_num for data segments
-    segment_num = 0;
+    // Now current_inode_index points to the parent directory
+    parent_inode_index = current_inode_index;
 
-    // Check data segments
-    while (1)
+    // Find the target file/directory in the parent
+    if (read_inode(parent_inode_index, &current_inode) < 0)
     {
-        // Generate segment filename
-        sprintf(filename, DATA_SEGMENT_NAME_PATTERN, segment_num);
+        fprintf(stderr, "Failed to read parent directory inode\n");
+        return -1;
+    }
 
-        // Try to open the file
-        file = fopen(filename, "rb");
-        if (file == NULL)
+    int target_inode_index = -1;
+    int found_target = 0;
+
+    for (int j = 0; j < MAX_DIRECT_BLOCKS; j++)
+    {
+        if (current_inode.direct_blocks[j] == MAX_UNIT_32 ||
+            current_inode.direct_blocks[j] == 0)
         {
-            // No more data segments
-            break;
+            continue;
         }
 
-        // Read the bitmap from the file
-        if (fread(bitmap, sizeof(bitmap), 1, file) != 1)
+        if (read_directory_block(current_inode.direct_blocks[j], &dir_block) < 0)
         {
-            perror("Failed to read bitmap");
-            fclose(file);
-            return -2;
+            continue;
         }
 
-        printf("Bitmap of %s: ", filename);
-        for (int j = 0; j < BITMAP_BYTES; j++)
+        for (int k = 0; k < MAX_DIRECTORY_ENTRIES; k++)
         {
-            printf("%u ", bitmap[j]);
+            if (dir_block.entries[k].inuse == 1 &&
+                strcmp(dir_block.entries[k].name, path_segments[segment_count - 1]) == 0)
+            {
+                target_inode_index = dir_block.entries[k].inode_number;
+                parent_dir_block_index = current_inode.direct_blocks[j];
+                entry_index_in_parent = k;
+                found_target = 1;
+                break;
+            }
         }
-        printf("\n");
 
-        // From the bitmap, list all the datablock details that are in use
-        for (int i = 0; i < BITMAP_BYTES; i++)
+        if (found_target)
         {
-            if (bitmap[i] == 1)
-            {
-                // First read it as a datablock to check the content
-                datablock_t datablock;
-                int result = read_datablock(i, &datablock);
+            break;
+        }
+    }
 
-                if (result < 0)
-                {
-                    fprintf(stderr, "Failed to read datablock %d\n", i);
-                    fclose(file);
-                    return -2;
-                }
+    if (!found_target || target_inode_index < 0)
+    {
+        fprintf(stderr, "Target %s not found in parent directory\n", path_segments[segment_count - 1]);
+        return -1;
+    }
+
+    // Remove the target file/directory recursively
+    if (remove_inode_and_blocks(target_inode_index) < 0)
+    {
+        fprintf(stderr, "Failed to remove target inode\n");
+        return -1;
+    }
 
-                // Try to read it as a directory block to check if it has valid entries
-                directoryblock_t directory_block;
-                if (read_directory_block(i, &directory_block) == 0)
-                {
-                    if (directory_block.entries[0].inuse == 1)
-                    {
-                        printf("Datablock %d: Directory Block, First entry: %s (inode: %u)\n",
-                               i, directory_block.entries[0].name, directory_block.entries[0].inode_number);
-                        continue;
-                    }
-                }
+    // Update parent directory to remove the entry
+    if (read_directory_block(parent_dir_block_index, &dir_block) < 0)
+    {
+        fprintf(stderr, "Failed to read parent directory block\n");
+        return -1;
+    }
 
-                // Otherwise print as regular datablock
-                printf("Datablock %d: Regular Block, Size: %lu \n", i, sizeof(datablock.data));
-            }
-        }
-        printf("\n");
+    // Mark the directory entry as not in use
+    dir_block.entries[entry_index_in_parent].inuse = 0;
 
-        fclose(file);
-        segment_num++;
+    // Write the updated directory block back
+    if (write_directory_block(parent_dir_block_index, &dir_block) < 0)
+    {
+        return -1;
     }
 
+    // // Free allocated memory for path segments
+    // for (int i = 0; i < segment_count; i++)
+    // {
+    //     free(path_segments[i]);
+    // }
+
     return 0;
 }
 
-// Forward declaration
-static void list_directory_recursive(int inode_number, int depth);
+// Online defragmentation (-G). Every regular file is scored by how many more extents its data is split into than its size needs, and the worst files are rewritten first. A file is copied into a contiguous run claimed with allocate_blocks near its directory, together with new indirect blocks, and only then is its inode switched over in a single write. Until that write the old blocks and old indirect blocks stay in place, so an interrupted run leaves either the old file or the new one, never a mix. The old blocks are freed afterwards.
+typedef struct
+{
+    uint32_t inode_number;
+    uint32_t goal;  // Data segment of the directory block naming the file
+    int runs;       // Extents the data is split into
+    int score;      // Extents beyond the fewest the file could be stored in
+    char path[256];
+} defrag_file_t;
 
-// Print entries in a directory block
-static void print_directory_entries(directoryblock_t *dir_block, int depth)
+typedef struct
 {
-    for (int i = 0; i < MAX_DIRECTORY_ENTRIES; i++)
-    {
-        if (dir_block->entries[i].inuse == 1)
-        {
-            // Print indentation
-            for (int j = 0; j < depth; j++)
-            {
-                printf("│   ");
-            }
+    defrag_file_t *files;
+    int count;
+    int capacity;
+} defrag_list_t;
 
-            printf("├── %s [Inode: %u, %s]\n",
-                   dir_block->entries[i].name,
-                   dir_block->entries[i].inode_number,
-                   dir_block->entries[i].type == FILE_TYPE_DIRECTORY ? "Directory" : "File");
+// Copy rate limit of the defragmenter, in bytes per second, 0 for none
+typedef struct
+{
+    uint32_t rate;
+    uint64_t bytes;
+    struct timespec start;
+} defrag_throttle_t;
 
-            // Recursively list subdirectories
-            if (dir_block->entries[i].type == FILE_TYPE_DIRECTORY)
-            {
-                list_directory_recursive(dir_block->entries[i].inode_number, depth + 1);
-            }
-        }
+// Function count_block_runs that returns the number of extents count block numbers are split into
+static int count_block_runs(uint32_t *blocks, int count)
+{
+    block_list_t list = {blocks, count, count};
+    int runs = 0;
+    for (int i = 0; i < count; i += block_list_run(&list, i, count))
+    {
+        runs++;
     }
+    return runs;
 }
 
-// Recursively list contents of a directory starting from the given inode
-static void list_directory_recursive(int inode_number, int depth)
+// Function defrag_scan that walks the directory tree below inode_number and adds every fragmented regular file to files, scored from its block map
+static void defrag_scan(int inode_number, const char *path, defrag_list_t *files)
 {
     inode_t inode;
-    int result = read_inode(inode_number, &inode);
-
-    if (result < 0)
+    if (read_inode(inode_number, &inode) < 0 || inode.type != FILE_TYPE_DIRECTORY)
     {
-        fprintf(stderr, "Failed to read inode %d\n", inode_number);
         return;
     }
 
-    if (inode.type != FILE_TYPE_DIRECTORY)
-    {
-        return; // Not a directory
-    }
-
-    // Process each direct block that could be a directory block
     for (int i = 0; i < MAX_DIRECT_BLOCKS; i++)
     {
-        if (inode.direct_blocks[i] != MAX_UNIT_32 && inode.direct_blocks[i] != 0)
+        directoryblock_t dir_block;
+        if (inode.direct_blocks[i] == MAX_UNIT_32 || inode.direct_blocks[i] == 0 || read_directory_block(inode.direct_blocks[i], &dir_block) < 0)
         {
-            directoryblock_t dir_block;
-            if (read_directory_block(inode.direct_blocks[i], &dir_block) == 0)
-            {
-                print_directory_entries(&dir_block, depth);
-            }
+            continue;
         }
-    }
-}
-
-// List directory starting from the root inode (inode 0)
-int list_directory(int unused)
-{
-    printf("Root [Inode: 0, Directory]\n");
-    list_directory_recursive(0, 1);
-    return 0;
-}
-
-// Function to initialize the file system that creates the first inode and first datasegments of the file system. The first inode is the root inode and the first datasegment is the root datasegment. The root inode is a directory and the root datasegment is a directory.
-int init_file_system()
-{
-    inode_t inode;
-    directoryblock_t directoryblock;
-    char inodeseg_filename[32];
-    char dataseg_filename[32];
 
-    sprintf(inodeseg_filename, INODE_SEGMENT_NAME_PATTERN, 0);
-    sprintf(dataseg_filename, DATA_SEGMENT_NAME_PATTERN, 0);
-
-    // Try to read the first inode segment and first data segment, if they exist the file system is already initialized
-    FILE *inode_segment = fopen(inodeseg_filename, "r");
-    FILE *data_segment = fopen(dataseg_filename, "r");
-
-    // Maybe we can only initialize the directory block upon need rather then prefilling it
-    if (data_segment == NULL && inode_segment == NULL)
-    {
-        for (int i = 0; i < MAX_DIRECTORY_ENTRIES; i++)
+        for (int j = 0; j < MAX_DIRECTORY_ENTRIES; j++)
         {
-            if (i == 0)
+            directory_entry_t *entry = &dir_block.entries[j];
+            if (entry->inuse != 1)
             {
+                continue;
+            }
 
-                directoryblock.entries[0].inode_number = MAX_UNIT_32;
-                directoryblock.entries[0].type = FILE_TYPE_DIRECTORY;
-                directoryblock.entries[0].inuse = 1;
-                strncpy(directoryblock.entries[0].name, "root", sizeof(directoryblock.entries[0].name) - 1);
-                directoryblock.entries[0].name[sizeof(directoryblock.entries[0].name) - 1] = '\0'; // Ensure null termination
+            char entry_path[256];
+            snprintf(entry_path, sizeof(entry_path), "%s/%s", path, entry->name);
+            if (entry->type == FILE_TYPE_DIRECTORY)
+            {
+                defrag_scan(entry->inode_number, entry_path, files);
+                continue;
             }
-            else
+
+            inode_t file_inode;
+            block_list_t list = {NULL, 0, 0};
+            if (read_inode(entry->inode_number, &file_inode) < 0 || file_inode.type != FILE_TYPE_REGULAR || collect_file_blocks(&file_inode, &list) < 0 || list.count == 0)
             {
-                directoryblock.entries[i].inode_number = MAX_UNIT_32;
-                directoryblock.entries[i].type = FILE_TYPE_REGULAR;
-                directoryblock.entries[i].inuse = 0;
-                strncpy(directoryblock.entries[i].name, "", sizeof(directoryblock.entries[i].name) - 1);
-                directoryblock.entries[i].name[sizeof(directoryblock.entries[i].name) - 1] = '\0'; // Ensure null termination
+                free(list.blocks);
+                continue;
             }
-        }
 
-        int root_directoryblock_index = create_directoryblock(&directoryblock);
+            int runs = count_block_runs(list.blocks, list.count);
+            int score = runs - (int)((list.count + geometry.blocks_per_segment - 1) / geometry.blocks_per_segment);
+            free(list.blocks);
+            if (score <= 0)
+            {
+                continue;
+            }
 
-        // printf("Directory Block Size: %lu\n", sizeof(directoryblock_t));
-        // printf("Directory Entry Size: %lu\n", sizeof(directory_entry_t));
-        // printf("Data Block Size: %lu\n", sizeof(datablock_t));
-        // printf("MAX_DIRECTORY_ENTRIES: %lu\n", MAX_DIRECTORY_ENTRIES);
-        // printf("INode Size: %lu\n", sizeof(inode_t));
+            if (files->count == files->capacity)
+            {
+                int capacity = files->capacity > 0 ? files->capacity * 2 : 64;
+                defrag_file_t *grown = realloc(files->files, capacity * sizeof(defrag_file_t));
+                if (grown == NULL)
+                {
+                    return;
+                }
+                files->files = grown;
+                files->capacity = capacity;
+            }
 
-        // fill MAX_DIRECT_BLOCKS with 0
-        for (int i = 0; i < MAX_DIRECT_BLOCKS; i++)
-        {
-            inode.direct_blocks[i] = 0; // Initialize direct blocks
+            defrag_file_t *file = &files->files[files->count++];
+            file->inode_number = entry->inode_number;
+            file->goal = inode.direct_blocks[i] / geometry.blocks_per_segment;
+            file->runs = runs;
+            file->score = score;
+            strcpy(file->path, entry_path);
         }
+    }
+}
 
-        // inode.direct_blocks[0] = root_directoryblock_index;
-        inode.type = FILE_TYPE_DIRECTORY; // Directory type
-        inode.size = 0;                   // Size is initially 0
-        inode.single_indirect = MAX_UNIT_32;
-        inode.double_indirect = MAX_UNIT_32;
-
-        int root_inode_index = create_inode(&inode);
-        if (root_inode_index < 0)
-        {
-            fprintf(stderr, "Failed to create root inode\n");
-            return -1;
-        }
+// Worst score first
+static int compare_defrag_files(const void *a, const void *b)
+{
+    const defrag_file_t *x = a;
+    const defrag_file_t *y = b;
+    return y->score != x->score ? y->score - x->score : (int)x->inode_number - (int)y->inode_number;
+}
 
-        return 0;
+// Sleep as long as needed to keep the bytes copied so far under the rate limit
+static void defrag_throttle(defrag_throttle_t *throttle, size_t bytes)
+{
+    throttle->bytes += bytes;
+    if (throttle->rate == 0)
+    {
+        return;
     }
-    else
+
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    double elapsed = (now.tv_sec - throttle->start.tv_sec) + (now.tv_nsec - throttle->start.tv_nsec) / 1e9;
+    double ahead = (double)throttle->bytes / throttle->rate - elapsed;
+    if (ahead > 0)
     {
-        fclose(data_segment);
-        return 0; // File system already initialized
+        struct timespec pause = {(time_t)ahead, (long)((ahead - (time_t)ahead) * 1e9)};
+        nanosleep(&pause, NULL);
     }
 }
 
-// Function remove_file that takes a path as input and removes the file from the file system. The function returns 0 on success and -1 on failure. The function navigate through the paths and recursively deletes the last segment. If its a file, just delete the file and if its a folder delete the folder and also delete everything in the folder recursively. By deleting, if its a inode then mark it as free in the bitmap and if its a datablock then mark it as free in the bitmap. The function also updates the parent directory to remove the entry for the deleted file or folder. For the directory entry, it should mark the inuse as 0.
-int remove_inode_and_blocks(int inode_number);
-
-// Helper function to mark inode as free in bitmap
-int free_inode(int inode_number)
+// Function defragment_file that rewrites one file into as few extents as free space allows. The copy and its indirect blocks or extent-tree blocks are written and synced before the inode is switched to them, and the old blocks are freed only after that. Files that would not end up in fewer extents are left alone. Returns 1 if the file was moved, 0 if it was left alone and -1 on failure.
+static int defragment_file(defrag_file_t *file, defrag_throttle_t *throttle)
 {
-    FILE *file = NULL;
-    char filename[32];
-    int segment_num = inode_number / 255;
-    int inode_index = inode_number % 255;
-
-    sprintf(filename, INODE_SEGMENT_NAME_PATTERN, segment_num);
-    file = fopen(filename, "r+b");
-    if (file == NULL)
+    inode_t inode;
+    block_list_t old = {NULL, 0, 0};
+    if (read_inode(file->inode_number, &inode) < 0 || collect_file_blocks(&inode, &old) < 0)
     {
-        // perror("Failed to open inode segment file");
+        free(old.blocks);
         return -1;
     }
 
-    // Update bitmap to mark inode as free
-    uint8_t bitmap[BITMAP_BYTES];
-    if (fread(bitmap, sizeof(bitmap), 1, file) != 1)
+    uint32_t total = old.count;
+    uint32_t *blocks = malloc(total * sizeof(uint32_t));
+    if (blocks == NULL || allocate_blocks(SEGMENT_KIND_DATA, total, file->goal, blocks) < 0)
     {
-        fclose(file);
+        free(blocks);
+        free(old.blocks);
         return -1;
     }
 
-    bitmap[inode_index] = 0; // Mark as free
-
-    fseek(file, 0, SEEK_SET);
-    fwrite(bitmap, sizeof(bitmap), 1, file);
-    fclose(file);
-
-    return 0;
-}
+    int runs = count_block_runs(blocks, old.count);
+    if (runs >= file->runs)
+    {
+        release_blocks(SEGMENT_KIND_DATA, blocks, total);
+        free(blocks);
+        free(old.blocks);
+        return 0;
+    }
 
-// Helper function to mark datablock as free in bitmap
-int free_datablock(int datablock_number)
-{
-    FILE *file = NULL;
-    char filename[32];
-    int segment_num = datablock_number / 255;
-    int block_index = datablock_number % 255;
+    // Copy the data, then build the new block map into a copy of the inode
+    uint8_t datablock[geometry.block_size];
+    int result = 0;
+    for (int i = 0; i < old.count && result == 0; i++)
+    {
+        result = read_block(SEGMENT_KIND_DATA, old.blocks[i], datablock, sizeof(datablock)) == 0 ? write_reserved_block(SEGMENT_KIND_DATA, blocks[i], datablock, sizeof(datablock)) : -1;
+        defrag_throttle(throttle, sizeof(datablock));
+    }
 
-    sprintf(filename, DATA_SEGMENT_NAME_PATTERN, segment_num);
-    file = fopen(filename, "r+b");
-    if (file == NULL)
+    inode_t moved = inode;
+    map_builder_t builder;
+    if (result == 0)
     {
-        // perror("Failed to open data segment file");
-        return -1;
+        result = map_builder_init(&builder, &moved, old.count, file->goal, USE_EXTENTS);
+        if (result == 0 && (map_builder_add(&builder, blocks, old.count) < 0 || map_builder_finish(&builder) < 0))
+        {
+            map_builder_abort(&builder, 0);
+            result = -1;
+        }
     }
 
-    // Update bitmap to mark block as free
-    uint8_t bitmap[BITMAP_BYTES];
-    if (fread(bitmap, sizeof(bitmap), 1, file) != 1)
+    // The new copy must be on disk before the inode points at it
+    sync_segments();
+    if (result < 0 || write_inode(file->inode_number, &moved) < 0)
     {
-        fclose(file);
+        fprintf(stderr, "Failed to relocate %s\n", file->path);
+        if (result < 0)
+        {
+            release_blocks(SEGMENT_KIND_DATA, blocks, total);
+        }
+        else
+        {
+            free_file_blocks(&moved);
+        }
+        free(blocks);
+        free(old.blocks);
         return -1;
     }
+    sync_segments();
 
-    bitmap[block_index] = 0; // Mark as free
+    free_file_blocks(&inode);
+    STAT_ADD(blocks_relocated, old.count);
+    printf("%s: %d runs -> %d runs\n", file->path, file->runs, runs);
 
-    fseek(file, 0, SEEK_SET);
-    fwrite(bitmap, sizeof(bitmap), 1, file);
-    fclose(file);
+    free(blocks);
+    free(old.blocks);
+    return 1;
+}
 
-    return 0;
+// Function defragment that relocates the fragmented files of the volume, worst first, copying at most rate bytes per second (0 for no limit). The function returns 0 on success and -1 on failure.
+int defragment(uint32_t rate)
+{
+    defrag_list_t files = {NULL, 0, 0};
+    defrag_scan(0, "", &files);
+    qsort(files.files, files.count, sizeof(defrag_file_t), compare_defrag_files);
+
+    defrag_throttle_t throttle = {rate, 0, {0, 0}};
+    clock_gettime(CLOCK_MONOTONIC, &throttle.start);
+
+    int moved = 0;
+    int result = 0;
+    for (int i = 0; i < files.count; i++)
+    {
+        int status = defragment_file(&files.files[i], &throttle);
+        if (status < 0)
+        {
+            result = -1;
+        }
+        moved += status > 0;
+    }
+
+    printf("Defragmented %d of %d fragmented files\n", moved, files.count);
+    free(files.files);
+    return result;
 }
 
-// Recursive function to remove an inode and all associated blocks
-int remove_inode_and_blocks(int inode_number)
+// Segment compaction (-K). Removing large files leaves sparsely used segments at the end of the volume that every full-volume scan still opens. Compaction picks, for each kind, the longest run of trailing segments that is on average at most COMPACT_MAX_USED_PERCENT full and whose live blocks fit in the free slots of the segments below it, so a few dense segments behind many empty ones are moved as well. Those blocks are copied to free slots below, first fit, and the directory tree is walked to point every reference at the copies. The old blocks are freed only after that, so an interrupted pass leaves references to either copy, both valid. The emptied segments are then removed with trim_free_segments.
+#ifndef COMPACT_MAX_USED_PERCENT
+#define COMPACT_MAX_USED_PERCENT 50
+#endif
+
+// Blocks moved by compaction, for one segment kind
+typedef struct
 {
-    inode_t inode;
-    int result = read_inode(inode_number, &inode);
-    if (result < 0)
+    uint32_t first;  // First block number of the segments being emptied
+    uint32_t length; // Block numbers covered by map, up to the end of the volume
+    uint32_t *map;   // New block number of each block from first on, MAX_UNIT_32 for free slots
+    uint32_t moved;  // Blocks copied
+} compact_map_t;
+
+static compact_map_t compact_maps[2];
+
+// Function compact_lookup that returns where block block_number of the given kind lives after compaction
+static uint32_t compact_lookup(int kind, uint32_t block_number)
+{
+    compact_map_t *map = &compact_maps[kind];
+    if (block_number < map->first || block_number - map->first >= map->length || map->map[block_number - map->first] == MAX_UNIT_32)
     {
-        return result;
+        return block_number;
     }
+    return map->map[block_number - map->first];
+}
 
-    // If it's a directory, recursively remove all entries
-    if (inode.type == FILE_TYPE_DIRECTORY)
+// Function compact_lookup_inode that returns the inode number of inode inode_number after compaction, which moves compact inodes with their inode block
+static uint32_t compact_lookup_inode(uint32_t inode_number)
+{
+    uint32_t per_block = geometry.inodes_per_block;
+    return compact_lookup(SEGMENT_KIND_INODE, inode_number / per_block) * per_block + inode_number % per_block;
+}
+
+// Function compact_plan that returns the first segment of the trailing run of segments of a kind that compaction empties, or the segment count if there is none
+static uint32_t compact_plan(int kind)
+{
+    uint32_t count = superblock.segment_count[kind];
+    uint32_t *used = calloc(count + 1, sizeof(uint32_t));
+    uint64_t free_below = 0;
+    if (used == NULL)
     {
-        for (int i = 0; i < MAX_DIRECT_BLOCKS; i++)
-        {
-            if (inode.direct_blocks[i] == MAX_UNIT_32 || inode.direct_blocks[i] == 0)
-            {
-                continue;
-            }
+        return count;
+    }
 
-            directoryblock_t dir_block;
-            if (read_directory_block(inode.direct_blocks[i], &dir_block) == 0)
-            {
-                // Remove all entries in this directory block
-                for (int j = 0; j < MAX_DIRECTORY_ENTRIES; j++)
-                {
-                    if (dir_block.entries[j].inuse == 1)
-                    {
-                        remove_inode_and_blocks(dir_block.entries[j].inode_number);
-                    }
-                }
-            }
+    for (uint32_t segment_num = 0; segment_num < count; segment_num++)
+    {
+        segment_handle_t *segment = get_segment(kind, segment_num, 0);
+        uint32_t free_count = segment != NULL && segment->bitmap != NULL ? bitmap_count_free(segment->bitmap) : 0;
+        used[segment_num] = geometry.blocks_per_segment - free_count;
+        free_below += free_count;
+    }
 
-            // Free the directory block
-            free_datablock(inode.direct_blocks[i]);
+    // Walk down from the last segment while the blocks of the run still fit below it, remembering the longest run sparse enough
+    uint32_t first = count;
+    uint64_t tail_used = 0;
+    for (uint32_t segment_num = count - 1; segment_num > 0; segment_num--)
+    {
+        free_below -= geometry.blocks_per_segment - used[segment_num];
+        tail_used += used[segment_num];
+        if (tail_used > free_below)
+        {
+            break;
+        }
+        if (tail_used * 100 <= (uint64_t)(count - segment_num) * geometry.blocks_per_segment * COMPACT_MAX_USED_PERCENT)
+        {
+            first = segment_num;
         }
     }
-    else
+
+    free(used);
+    return first;
+}
+
+// Function compact_move_blocks that copies every block of a kind from segment first on into a free slot below it and records the move in compact_maps. Returns 0 on success and -1 on failure.
+static int compact_move_blocks(int kind, uint32_t first)
+{
+    compact_map_t *map = &compact_maps[kind];
+    map->first = first * geometry.blocks_per_segment;
+    map->length = (superblock.segment_count[kind] - first) * geometry.blocks_per_segment;
+    map->map = malloc((map->length + 1) * sizeof(uint32_t));
+    if (map->map == NULL)
     {
-        // Regular file - free all datablocks
-        for (int i = 0; i < MAX_DIRECT_BLOCKS; i++)
-        {
-            if (inode.direct_blocks[i] != MAX_UNIT_32 && inode.direct_blocks[i] != 0)
-            {
-                free_datablock(inode.direct_blocks[i]);
-            }
-        }
+        return -1;
     }
+    memset(map->map, 0xff, (map->length + 1) * sizeof(uint32_t));
 
-    // Also handle indirect blocks if they're used
-    if (inode.single_indirect != 0 && inode.single_indirect != MAX_UNIT_32)
+    uint8_t block[geometry.block_size];
+    for (uint32_t i = 0; i < map->length; i++)
     {
-        // Read the indirect block and free all referenced blocks
-        datablock_t indirect_block;
-        if (read_datablock(inode.single_indirect, &indirect_block) == 0)
+        uint32_t block_number = map->first + i;
+        int result = read_block(kind, block_number, block, sizeof(block));
+        if (result == -2)
         {
-            uint32_t *block_pointers = (uint32_t *)indirect_block.data;
-            for (int i = 0; i < BLOCK_SIZE / sizeof(uint32_t); i++)
-            {
-                if (block_pointers[i] != 0 && block_pointers[i] != MAX_UNIT_32)
-                {
-                    free_datablock(block_pointers[i]);
-                }
-            }
+            continue; // Free slot
+        }
+
+        int moved = result == 0 ? create_block(kind, ALLOC_GOAL_FIRST, block, sizeof(block)) : -1;
+        if (moved < 0 || (uint32_t)moved >= map->first)
+        {
+            fprintf(stderr, "Failed to move block %u\n", block_number);
+            return -1;
         }
-        free_datablock(inode.single_indirect);
+        map->map[i] = moved;
+        map->moved++;
+    }
+    return 0;
+}
+
+// Function compact_relink_block that rewrites the entries of the directory block, or legacy indirect block, at block_number, which point at blocks of the given kind, to their locations after compaction. Returns the new location of the block itself, or MAX_UNIT_32 on failure.
+static uint32_t compact_relink_block(uint32_t block_number, int kind)
+{
+    uint32_t moved = compact_lookup(SEGMENT_KIND_DATA, block_number);
+    directoryblock_t pointer_block;
+    if (read_directory_block(moved, &pointer_block) < 0)
+    {
+        return MAX_UNIT_32;
     }
 
-    if (inode.double_indirect != 0 && inode.double_indirect != MAX_UNIT_32)
+    int changed = 0;
+    for (int i = 0; i < MAX_DIRECTORY_ENTRIES; i++)
     {
-        // Read the double indirect block
-        datablock_t double_indirect_block;
-        if (read_datablock(inode.double_indirect, &double_indirect_block) == 0)
+        uint32_t target = pointer_block.entries[i].inode_number;
+        uint32_t relinked = kind == SEGMENT_KIND_INODE ? compact_lookup_inode(target) : compact_lookup(kind, target);
+        if (pointer_block.entries[i].inuse == 1 && relinked != target)
         {
-            uint32_t *indirect_pointers = (uint32_t *)double_indirect_block.data;
-            for (int i = 0; i < BLOCK_SIZE / sizeof(uint32_t); i++)
-            {
-                if (indirect_pointers[i] != 0 && indirect_pointers[i] != MAX_UNIT_32)
-                {
-                    // Read each single indirect block
-                    datablock_t indirect_block;
-                    if (read_datablock(indirect_pointers[i], &indirect_block) == 0)
-                    {
-                        uint32_t *block_pointers = (uint32_t *)indirect_block.data;
-                        for (int j = 0; j < BLOCK_SIZE / sizeof(uint32_t); j++)
-                        {
-                            if (block_pointers[j] != 0 && block_pointers[j] != MAX_UNIT_32)
-                            {
-                                free_datablock(block_pointers[j]);
-                            }
-                        }
-                    }
-                    free_datablock(indirect_pointers[i]);
-                }
-            }
+            pointer_block.entries[i].inode_number = relinked;
+            changed = 1;
         }
-        free_datablock(inode.double_indirect);
     }
 
-    // Finally, free the inode itself
-    return free_inode(inode_number);
+    if (changed && write_directory_block(moved, &pointer_block) < 0)
+    {
+        return MAX_UNIT_32;
+    }
+    return moved;
 }
 
-int remove_file(const char *path)
+// Function compact_relink_array that rewrites the block numbers in the indirect block of an INODE_POINTER_ARRAYS inode at block_number to their locations after compaction. Returns the new location of the block itself, or MAX_UNIT_32 on failure.
+static uint32_t compact_relink_array(uint32_t block_number)
 {
-    char *path_segments[10];
-    int segment_count = split_path(path, path_segments, 10);
-    if (segment_count <= 0)
+    uint32_t moved = compact_lookup(SEGMENT_KIND_DATA, block_number);
+    uint32_t pointers[POINTERS_PER_BLOCK];
+    if (read_block(SEGMENT_KIND_DATA, moved, pointers, geometry.block_size) < 0)
     {
-        return -1; // Invalid path
+        return MAX_UNIT_32;
     }
 
-    // Start with root inode
-    int current_inode_index = 0;
-    int parent_inode_index = 0;
-    int parent_dir_block_index = -1;
-    int entry_index_in_parent = -1;
-
-    inode_t current_inode;
-    directoryblock_t dir_block;
-
-    // Navigate to the parent of the target file/directory
-    for (int i = 0; i < segment_count - 1; i++)
+    int changed = 0;
+    for (uint32_t i = 0; i < POINTERS_PER_BLOCK; i++)
     {
-        if (read_inode(current_inode_index, &current_inode) < 0)
+        if (pointers[i] != MAX_UNIT_32 && compact_lookup(SEGMENT_KIND_DATA, pointers[i]) != pointers[i])
         {
-            fprintf(stderr, "Failed to read inode at index %d\n", current_inode_index);
-            return -1;
+            pointers[i] = compact_lookup(SEGMENT_KIND_DATA, pointers[i]);
+            changed = 1;
         }
+    }
 
-        if (current_inode.type != FILE_TYPE_DIRECTORY)
+    if (changed && write_block(SEGMENT_KIND_DATA, moved, pointers, geometry.block_size) < 0)
+    {
+        return MAX_UNIT_32;
+    }
+    return moved;
+}
+
+// Function compact_relink_indirect that relinks an indirect block of inode in the format the inode uses, see compact_relink_array and compact_relink_block
+static uint32_t compact_relink_indirect(const inode_t *inode, uint32_t block_number)
+{
+    return inode->flags & INODE_POINTER_ARRAYS ? compact_relink_array(block_number) : compact_relink_block(block_number, SEGMENT_KIND_DATA);
+}
+
+// Function compact_relink_level that relinks indirect block block_number of inode, level levels above the data, and the indirect blocks below it, reading each level above the bottom one into its buffer of walk. Returns the new location of the block, or MAX_UNIT_32 on failure.
+static uint32_t compact_relink_level(pointer_walk_t *walk, const inode_t *inode, uint32_t block_number, int level)
+{
+    if (level > 1)
+    {
+        uint32_t *pointers = walk->levels[level - 1];
+        int count = read_pointers(inode, compact_lookup(SEGMENT_KIND_DATA, block_number), pointers);
+        if (count < 0)
         {
-            fprintf(stderr, "Path component %s is not a directory\n", path_segments[i]);
-            return -1;
+            return MAX_UNIT_32;
         }
-
-        int found_next_segment = 0;
-        for (int j = 0; j < MAX_DIRECT_BLOCKS; j++)
+        for (int m = 0; m < count; m++)
         {
-            if (current_inode.direct_blocks[j] == MAX_UNIT_32 ||
-                current_inode.direct_blocks[j] == 0)
+            if (compact_relink_level(walk, inode, pointers[m], level - 1) == MAX_UNIT_32)
             {
-                continue;
+                return MAX_UNIT_32;
             }
+        }
+    }
+    return compact_relink_indirect(inode, block_number);
+}
 
-            if (read_directory_block(current_inode.direct_blocks[j], &dir_block) < 0)
+// Function compact_relink_tree that relinks indirect block block_number of inode, level levels above the data, and the indirect blocks below it, see compact_relink_indirect. Returns the new location of the block, or MAX_UNIT_32 on failure.
+static uint32_t compact_relink_tree(const inode_t *inode, uint32_t block_number, int level)
+{
+    pointer_walk_t walk;
+    if (pointer_walk_init(&walk, level) < 0)
+    {
+        return MAX_UNIT_32;
+    }
+    uint32_t moved = compact_relink_level(&walk, inode, block_number, level);
+    pointer_walk_release(&walk);
+    return moved;
+}
+
+// Function compact_relink_extents that rebuilds the extent tree of the INODE_EXTENTS inode into relinked from the locations of its data blocks after compaction, since a run of moved blocks may no longer be consecutive. The new extent-tree blocks are claimed below the segments being emptied. The old tree is read from its original blocks, which compaction frees, and the copies compact_move_blocks made of them are freed here once the inode no longer needs them. inode_number is where the inode is now. Returns 0 on success and -1 on failure.
+static int compact_relink_extents(uint32_t inode_number, const inode_t *inode, inode_t *relinked)
+{
+    block_list_t list = {NULL, 0, 0};
+    block_list_t nodes = {NULL, 0, 0};
+    if (collect_file_blocks((inode_t *)inode, &list) < 0 || collect_extent_nodes(inode->extents, inode->extent_header.count, inode->extent_header.depth, &nodes) < 0)
+    {
+        free(list.blocks);
+        free(nodes.blocks);
+        return -1;
+    }
+
+    int changed = 0;
+    for (int i = 0; i < list.count; i++)
+    {
+        changed |= compact_lookup(SEGMENT_KIND_DATA, list.blocks[i]) != list.blocks[i];
+        list.blocks[i] = compact_lookup(SEGMENT_KIND_DATA, list.blocks[i]);
+    }
+    for (int i = 0; i < nodes.count; i++)
+    {
+        changed |= compact_lookup(SEGMENT_KIND_DATA, nodes.blocks[i]) != nodes.blocks[i];
+    }
+
+    int result = 0;
+    if (changed)
+    {
+        block_list_t built = {NULL, 0, 0};
+        result = write_file_extents(relinked, list.blocks, list.count, ALLOC_GOAL_FIRST);
+        if (result == 0)
+        {
+            result = collect_extent_nodes(relinked->extents, relinked->extent_header.count, relinked->extent_header.depth, &built);
+            for (int i = 0; i < built.count && result == 0; i++)
             {
-                continue;
+                result = compact_maps[SEGMENT_KIND_DATA].length == 0 || built.blocks[i] < compact_maps[SEGMENT_KIND_DATA].first ? 0 : -1;
             }
-
-            for (int k = 0; k < MAX_DIRECTORY_ENTRIES; k++)
+            if (result == 0)
             {
-                if (dir_block.entries[k].inuse == 1 &&
-                    strcmp(dir_block.entries[k].name, path_segments[i]) == 0)
-                {
-                    parent_inode_index = current_inode_index;
-                    current_inode_index = dir_block.entries[k].inode_number;
-                    found_next_segment = 1;
-                    break;
-                }
+                result = write_inode(inode_number, relinked);
             }
-
-            if (found_next_segment)
+            if (result < 0)
             {
-                break;
+                release_blocks(SEGMENT_KIND_DATA, built.blocks, built.count);
             }
         }
+        free(built.blocks);
+    }
 
-        if (!found_next_segment)
-        {
-            fprintf(stderr, "Path component %s not found\n", path_segments[i]);
-            return -1;
-        }
+    // The old tree is no longer referenced, the originals of moved blocks are freed with the rest of the segments being emptied
+    for (int i = 0; i < nodes.count && changed && result == 0; i++)
+    {
+        free_datablock(compact_lookup(SEGMENT_KIND_DATA, nodes.blocks[i]));
     }
 
-    // Now current_inode_index points to the parent directory
-    parent_inode_index = current_inode_index;
+    free(list.blocks);
+    free(nodes.blocks);
+    return result;
+}
 
-    // Find the target file/directory in the parent
-    if (read_inode(parent_inode_index, &current_inode) < 0)
+// Function compact_relink that points the inode inode_number, and everything below it, at the locations of their blocks after compaction. Directories are followed through their entries. Returns 0 on success and -1 on failure.
+static int compact_relink(uint32_t inode_number)
+{
+    uint32_t moved = compact_lookup_inode(inode_number);
+    inode_t inode;
+    if (read_inode(moved, &inode) < 0)
     {
-        fprintf(stderr, "Failed to read parent directory inode\n");
         return -1;
     }
 
-    int target_inode_index = -1;
-    int found_target = 0;
+    inode_t relinked = inode;
+    if (inode.flags & INODE_INLINE)
+    {
+        return 0;
+    }
+    else if (inode.flags & INODE_EXTENTS)
+    {
+        return compact_relink_extents(moved, &inode, &relinked);
+    }
 
-    for (int j = 0; j < MAX_DIRECT_BLOCKS; j++)
+    for (int i = 0; i < MAX_DIRECT_BLOCKS; i++)
     {
-        if (current_inode.direct_blocks[j] == MAX_UNIT_32 ||
-            current_inode.direct_blocks[j] == 0)
+        if (inode.direct_blocks[i] == MAX_UNIT_32 || (inode.type == FILE_TYPE_DIRECTORY && inode.direct_blocks[i] == 0))
         {
             continue;
         }
-
-        if (read_directory_block(current_inode.direct_blocks[j], &dir_block) < 0)
+        if (inode.type != FILE_TYPE_DIRECTORY)
         {
+            relinked.direct_blocks[i] = compact_lookup(SEGMENT_KIND_DATA, inode.direct_blocks[i]);
             continue;
         }
 
-        for (int k = 0; k < MAX_DIRECTORY_ENTRIES; k++)
+        // Subdirectories first, then the entries pointing at them
+        directoryblock_t dir_block;
+        if (read_directory_block(compact_lookup(SEGMENT_KIND_DATA, inode.direct_blocks[i]), &dir_block) < 0)
         {
-            if (dir_block.entries[k].inuse == 1 &&
-                strcmp(dir_block.entries[k].name, path_segments[segment_count - 1]) == 0)
+            return -1;
+        }
+        for (int j = 0; j < MAX_DIRECTORY_ENTRIES; j++)
+        {
+            if (dir_block.entries[j].inuse == 1 && compact_relink(dir_block.entries[j].inode_number) < 0)
             {
-                target_inode_index = dir_block.entries[k].inode_number;
-                parent_dir_block_index = current_inode.direct_blocks[j];
-                entry_index_in_parent = k;
-                found_target = 1;
-                break;
+                return -1;
             }
         }
+        relinked.direct_blocks[i] = compact_relink_block(inode.direct_blocks[i], SEGMENT_KIND_INODE);
+        if (relinked.direct_blocks[i] == MAX_UNIT_32)
+        {
+            return -1;
+        }
+    }
 
-        if (found_target)
+    if (inode.single_indirect != MAX_UNIT_32)
+    {
+        relinked.single_indirect = compact_relink_tree(&inode, inode.single_indirect, 1);
+        if (relinked.single_indirect == MAX_UNIT_32)
         {
-            break;
+            return -1;
         }
     }
 
-    if (!found_target || target_inode_index < 0)
+    if (inode.double_indirect != MAX_UNIT_32)
     {
-        fprintf(stderr, "Target %s not found in parent directory\n", path_segments[segment_count - 1]);
-        return -1;
+        relinked.double_indirect = compact_relink_tree(&inode, inode.double_indirect, 2);
+        if (relinked.double_indirect == MAX_UNIT_32)
+        {
+            return -1;
+        }
     }
 
-    // Remove the target file/directory recursively
-    if (remove_inode_and_blocks(target_inode_index) < 0)
+    if (inode.triple_indirect != 0 && inode.triple_indirect != MAX_UNIT_32)
     {
-        fprintf(stderr, "Failed to remove target inode\n");
-        return -1;
+        relinked.triple_indirect = compact_relink_tree(&inode, inode.triple_indirect, 3);
+        if (relinked.triple_indirect == MAX_UNIT_32)
+        {
+            return -1;
+        }
     }
 
-    // Update parent directory to remove the entry
-    if (read_directory_block(parent_dir_block_index, &dir_block) < 0)
+    if (memcmp(&relinked, &inode, sizeof(inode_t)) != 0 && write_inode(moved, &relinked) < 0)
     {
-        fprintf(stderr, "Failed to read parent directory block\n");
         return -1;
     }
+    return 0;
+}
 
-    // Mark the directory entry as not in use
-    dir_block.entries[entry_index_in_parent].inuse = 0;
+// Function compact_volume that empties the sparse segments at the end of the volume into free space below them and removes them. The function returns 0 on success and -1 on failure.
+int compact_volume()
+{
+    uint32_t before[2];
+    uint32_t first[2];
+    for (int kind = 0; kind < 2; kind++)
+    {
+        before[kind] = superblock.segment_count[kind];
+        first[kind] = compact_plan(kind);
+    }
+    if (first[SEGMENT_KIND_INODE] == before[SEGMENT_KIND_INODE] && first[SEGMENT_KIND_DATA] == before[SEGMENT_KIND_DATA])
+    {
+        printf("Nothing to compact\n");
+        return 0;
+    }
 
-    // Write the updated directory block back
-    FILE *file = NULL;
-    char filename[32];
-    int segment_num = parent_dir_block_index / 255;
-    int block_index = parent_dir_block_index % 255;
+    // Copy the blocks, then point the tree at the copies, then free the originals, syncing in between
+    int result = 0;
+    for (int kind = 0; kind < 2 && result == 0; kind++)
+    {
+        result = first[kind] < before[kind] ? compact_move_blocks(kind, first[kind]) : 0;
+    }
+    sync_segments();
+    int relinked = 0;
+    if (result == 0)
+    {
+        result = compact_relink(0);
+        relinked = 1;
+    }
+    sync_segments();
 
-    sprintf(filename, DATA_SEGMENT_NAME_PATTERN, segment_num);
-    file = fopen(filename, "r+b");
-    if (file == NULL)
+    // A failed relink may have left references to either copy, so both are kept. Copies nothing points at yet are freed.
+    for (int kind = 0; kind < 2 && (result == 0 || !relinked); kind++)
+    {
+        compact_map_t *map = &compact_maps[kind];
+        for (uint32_t i = 0; i < map->length && map->map != NULL; i++)
+        {
+            if (map->map[i] != MAX_UNIT_32)
+            {
+                free_block(kind, result == 0 ? map->first + i : map->map[i]);
+            }
+        }
+    }
+    sync_segments();
+
+    for (int kind = 0; kind < 2; kind++)
+    {
+        trim_free_segments(kind);
+        free(compact_maps[kind].map);
+    }
+    if (result < 0)
     {
+        fprintf(stderr, "Failed to compact the volume\n");
         return -1;
     }
 
-    fseek(file, (block_index + 1) * BLOCK_SIZE, SEEK_SET);
-    fwrite(&dir_block, sizeof(directoryblock_t), 1, file);
-    fclose(file);
+    printf("Moved %u inode blocks and %u data blocks, inode segments %u -> %u, data segments %u -> %u\n", compact_maps[SEGMENT_KIND_INODE].moved, compact_maps[SEGMENT_KIND_DATA].moved,
+           before[SEGMENT_KIND_INODE], superblock.segment_count[SEGMENT_KIND_INODE], before[SEGMENT_KIND_DATA], superblock.segment_count[SEGMENT_KIND_DATA]);
+    return 0;
+}
 
-    // // Free allocated memory for path segments
-    // for (int i = 0; i < segment_count; i++)
-    // {
-    //     free(path_segments[i]);
-    // }
+// Parse a size given on the command line, in bytes or with a K or M suffix. Returns 0 if the size is invalid.
+static uint32_t parse_size(const char *text)
+{
+    char *end;
+    unsigned long size = strtoul(text, &end, 10);
 
-    return 0;
+    if (*end == 'K' || *end == 'k')
+    {
+        size *= 1024;
+        end++;
+    }
+    else if (*end == 'M' || *end == 'm')
+    {
+        size *= 1024 * 1024;
+        end++;
+    }
+
+    return (*end == '\0' && size <= UINT32_MAX) ? size : 0;
 }
 
 /*
@@ -2152,22 +5561,22 @@ int main(int argc, char *argv[])
     int opt;
     char *fs_path = NULL;
     char *local_file = NULL;
-
-    // Initialize file system
-    if (init_file_system() != 0)
-    {
-        fprintf(stderr, "Failed to initialize file system\n");
-        return 1;
-    }
-
-    // Parse command line arguments
-    while ((opt = getopt(argc, argv, "la:f:r:e:D:")) != -1)
+    uint32_t block_size = 0;   // Geometry of a volume formatted by this run, 0 for the default
+    uint32_t segment_size = 0;
+
+#ifdef EXFS_STATS
+    atexit(print_stats);
+#endif
+    // Segment files stay open for the whole run and are closed on exit
+    atexit(close_segment_files);
+
+    // Parse command line arguments. The first of -l, -r, -e, -D, -C, -G and -K is the action to run.
+    int action = 0;
+    char *action_path = NULL;
+    while ((opt = getopt(argc, argv, "la:f:r:e:D:CKB:S:G:")) != -1)
     {
         switch (opt)
         {
-        case 'l': // List directory
-            return list_directory(0);
-
         case 'a': // Add file path
             fs_path = optarg;
             break;
@@ -2176,19 +5585,79 @@ int main(int argc, char *argv[])
             local_file = optarg;
             break;
 
-        case 'r': // Remove file
-            return remove_file(optarg);
+        case 'B': // Block size of a new volume
+            block_size = parse_size(optarg);
+            if (block_size == 0)
+            {
+                fprintf(stderr, "Invalid block size: %s\n", optarg);
+                return 1;
+            }
+            break;
 
-        case 'e': // Extract file
-            return extract_file(optarg, 1);
+        case 'S': // Segment size of a new volume
+            segment_size = parse_size(optarg);
+            if (segment_size == 0)
+            {
+                fprintf(stderr, "Invalid segment size: %s\n", optarg);
+                return 1;
+            }
+            break;
 
+        case 'l': // List directory
+        case 'r': // Remove file
+        case 'e': // Extract file
         case 'D': // Debug path
-            return debug_path(optarg);
+        case 'C': // Convert legacy segment files into an image
+        case 'G': // Defragment, copying at most the given bytes per second
+        case 'K': // Compact the sparse segments at the end of the volume
+            if (action == 0)
+            {
+                action = opt;
+                action_path = optarg;
+            }
+            break;
 
         default:
-            fprintf(stderr, "Usage: %s [-l] [-a fs_path -f local_file] [-r path] [-e path] [-D path]\n", argv[0]);
+            fprintf(stderr, "Usage: %s [-l] [-a fs_path -f local_file] [-r path] [-e path] [-D path] [-C] [-G rate] [-K] [-B block_size -S segment_size]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    // The converter works on the segment files directly and must run before they are opened
+    if (action == 'C')
+    {
+        return convert_to_image() == 0 ? 0 : 1;
+    }
+
+    // Initialize file system
+    if (open_volume(block_size, segment_size) != 0 || init_file_system() != 0)
+    {
+        fprintf(stderr, "Failed to initialize file system\n");
+        return 1;
+    }
+
+    switch (action)
+    {
+    case 'l':
+        return list_directory(0);
+    case 'r':
+        return remove_file(action_path);
+    case 'e':
+        return extract_file(action_path, 1);
+    case 'D':
+        return debug_path(action_path);
+    case 'G':
+    {
+        uint32_t rate = parse_size(action_path);
+        if (rate == 0 && strcmp(action_path, "0") != 0)
+        {
+            fprintf(stderr, "Invalid rate: %s\n", action_path);
             return 1;
         }
+        return defragment(rate) == 0 ? 0 : 1;
+    }
+    case 'K':
+        return compact_volume() == 0 ? 0 : 1;
     }
 
     // Handle adding a file if both -a and -f were specified
@@ -2204,6 +5673,6 @@ int main(int argc, char *argv[])
     }
 
     // Default action if no arguments were provided
-    fprintf(stderr, "Usage: %s [-l] [-a fs_path -f local_file] [-r path] [-e path] [-D path]\n", argv[0]);
+    fprintf(stderr, "Usage: %s [-l] [-a fs_path -f local_file] [-r path] [-e path] [-D path] [-C] [-G rate] [-K] [-B block_size -S segment_size]\n", argv[0]);
     return 1;
 }